@@ -1,4 +1,7 @@
+// Build with -DMOCK_MICRO to run the micro build on Linux against a simulated board
+#ifndef MOCK_MICRO
 #define LAPTOP_MODE
+#endif
 
 #ifndef LAPTOP_MODE
 #define MICRO_MODE
@@ -7,32 +10,243 @@
 #ifdef LAPTOP_MODE
 #include <iostream>
 #include <SDL2/SDL.h>
-#include <SDL_gfx/SDL2_gfxPrimitives.h>
 #include <chrono>
 #include <sys/timeb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <functional>
+#include <stdarg.h>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <cstddef>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <errno.h>
+#include <memory>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+// Arduino core types, so the shared code below compiles unchanged on the laptop
+typedef uint8_t byte;
+typedef unsigned int word;
+#define PROGMEM
+inline byte progmemByte(const byte *address) { return *address; }
+inline word progmemWord(const word *address) { return *address; }
 SDL_Window *_window;
 SDL_Renderer *renderer;
+// The preview framebuffer is uploaded into this once per frame
+SDL_Texture *previewTexture;
+// Whether the window shows the frame at full resolution rather than what the strip is sent
+bool previewGradients = false;
+#endif
+
+// How many NeoPixels are attached to the Arduino?
+#define LED_COUNT 50
+
+// Marks the state that belongs to one board. The laptop can run several boards, each on its own
+// thread (see --boards), so there it is thread-local; the micro is one board with plain globals.
+#ifdef LAPTOP_MODE
+#define BOARD_LOCAL thread_local
+#else
+#define BOARD_LOCAL
 #endif
 
 #ifdef MICRO_MODE
+#ifdef MOCK_MICRO
+// A stand-in for the Arduino core and the NeoPixel library, so the micro build runs on Linux. Pins
+// and dials are simulated. The strip's output is captured, and the board's clock is modeled: each
+// core call costs a configurable number of cycles, the code between calls costs the host time it
+// took scaled by mockCpuScale, and show() keeps interrupts off, which makes millis() lose ticks.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+typedef uint8_t byte;
+typedef unsigned int word;
+#define PROGMEM
+#define pgm_read_byte(address) (*(const byte *)(address))
+#define pgm_read_word(address) (*(const word *)(address))
+#define INPUT 0
+#define INPUT_PULLUP 2
+#define A4 18
+#define NEO_GRB 0x52
+#define NEO_KHZ800 0x0000
+const double MOCK_F_CPU = 16000000;
+
+// Cycles each core call costs, from the AVR core's implementations at 16 MHz
+struct MockCosts
+{
+  double digitalRead = 60;
+  double analogRead = 1700; // One 13-cycle ADC conversion at the default 125 kHz ADC clock
+  double millis = 40;
+  double random = 1000;     // 32-bit Park-Miller in software
+  double trace = 350;       // Queueing a trace record, plus the TX interrupts that send its 6 bytes
+  double showPerLed = 480;  // 30 us of bit-banging per LED, with interrupts off
+  double showOverhead = 800;
+};
+MockCosts mockCosts;
+// How many times slower the micro runs the code between core calls than this machine does. The AVR
+// has no FPU, so float-heavy effects are far slower there than plain integer code; calibrate this
+// against a real board when it matters.
+double mockCpuScale = 1000;
+
+// The simulated board
+bool mockPins[20];
+int mockAnalog[8];
+// Time on the board, in cycles, and how much of it millis() missed while interrupts were off
+double mockCycles = 0;
+double mockLostMicros = 0;
+// Where each part of the board's time went
+double mockShowCycles = 0;
+double mockCoreCycles = 0;
+double mockComputeCycles = 0;
+std::chrono::steady_clock::time_point mockHostTime = std::chrono::steady_clock::now();
+// When each snake tick happened on the board, in microseconds
+std::vector<double> mockTicks;
+
+double mockMicros() { return mockCycles * 1000000 / MOCK_F_CPU; }
+
+// Charges the host time since the last core call, scaled to the micro, then the call itself
+void mockSpend(double cycles, double &category)
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  double compute = std::chrono::duration<double>(now - mockHostTime).count() * MOCK_F_CPU * mockCpuScale;
+  mockComputeCycles += compute;
+  mockCycles += compute + cycles;
+  category += cycles;
+  mockHostTime = std::chrono::steady_clock::now();
+}
+
+void pinMode(byte pin, byte mode) {}
+bool digitalRead(byte pin)
+{
+  mockSpend(mockCosts.digitalRead, mockCoreCycles);
+  return mockPins[pin];
+}
+int analogRead(byte pin)
+{
+  mockSpend(mockCosts.analogRead, mockCoreCycles);
+  return pin == A4 ? rand() % 1024 : mockAnalog[pin];
+}
+unsigned long millis()
+{
+  mockSpend(mockCosts.millis, mockCoreCycles);
+  return (unsigned long)((mockMicros() - mockLostMicros) / 1000);
+}
+long random(long low, long high)
+{
+  mockSpend(mockCosts.random, mockCoreCycles);
+  return high > low ? low + rand() % (high - low) : low;
+}
+void randomSeed(unsigned long seed) { srand(seed); }
+
+class Adafruit_NeoPixel
+{
+  byte *_pixels;
+  int _count;
+
+public:
+  // What the strip was last sent, and how many times
+  byte *shown;
+  unsigned long shows = 0;
+  FILE *capture = NULL;
+
+  Adafruit_NeoPixel(int count, byte pin, int type) : _count(count)
+  {
+    _pixels = (byte *)calloc(count * 3, 1);
+    shown = (byte *)calloc(count * 3, 1);
+  }
+  void begin() {}
+  void setBrightness(byte brightness) {}
+  byte *getPixels() { return _pixels; }
+  void show()
+  {
+    double cycles = mockCosts.showOverhead + mockCosts.showPerLed * _count;
+    mockSpend(0, mockCoreCycles);
+    double start = mockMicros();
+    mockSpend(cycles, mockShowCycles);
+    // Timer 0 overflows every 1024 us. With interrupts off, only one overflow stays pending.
+    int overflows = (int)(mockMicros() / 1024) - (int)(start / 1024);
+    if (overflows > 1)
+    {
+      mockLostMicros += (overflows - 1) * 1024;
+    }
+    memcpy(shown, _pixels, _count * 3);
+    shows++;
+    if (capture)
+    {
+      fwrite(shown, 1, _count * 3, capture);
+    }
+  }
+};
+#else
 #include <Adafruit_NeoPixel.h>
+#endif
 // Which pin on the Arduino is connected to the NeoPixels?
 // On a Trinket or Gemma we suggest changing this to 1:d
 #define LED_PIN 11
-// How many NeoPixels are attached to the Arduino?
-#define LED_COUNT 50
 // The analog pins to control the rainbow center
 #define DIAL_PIN_X 1
 #define DIAL_PIN_Y 2
 #define DIAL_PIN_SPEED 0
 Adafruit_NeoPixel strip(LED_COUNT, LED_PIN, NEO_GRB + NEO_KHZ800);
+inline byte progmemByte(const byte *address) { return pgm_read_byte(address); }
+inline word progmemWord(const word *address) { return pgm_read_word(address); }
 #endif
 
 #include <math.h>
 
-const byte actual_leds[] = {
-    1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-    21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36};
+// A stretch of the strip wired along consecutive lines
+struct StripRun
+{
+  word firstLed;    // Where the run starts on the strip
+  byte firstLine;   // The first line it covers
+  byte lineCount;   // How many lines it covers
+  byte ledsPerLine; // How many LEDs sit on each line
+  bool reversed;    // The first line is wired from its end back to its start
+  bool serpentine;  // Every other line is wired the opposite way, as on a zigzag
+};
+
+// How the physical strip is laid over the board
+const StripRun stripLayout[] = {
+    {1, 0, 16, 1, false, false},
+    {21, 16, 16, 1, false, false},
+};
+
+// Byte offsets of each color within an LED in the strip buffer (NEO_GRB)
+const byte STRIP_RED = 1;
+const byte STRIP_GREEN = 0;
+const byte STRIP_BLUE = 2;
 
 // Indexes into the neighbor arrays for the left, straight and right next lines on the grid
 const byte LEFT PROGMEM = 0;
@@ -45,29 +259,16 @@ const int GREEN_HUE PROGMEM = 300;
 const int BLUE_HUE PROGMEM = 359;
 
 // The direction the user is trying to move the snake. Updated when the user is holding a button during a tick.
-byte direction = STRAIGHT;
+BOARD_LOCAL byte direction = STRAIGHT;
 
 // Whether we're showing a rainbow or plaing Snake
-bool rainbow = true;
-
-bool isRainbowMode()
-{
-#ifdef LAPTOP_MODE
-  return rainbow;
-#endif
-#ifdef MICRO_MODE
-  return digitalRead(6);
-#endif
-}
+BOARD_LOCAL bool rainbow = true;
 
 // If > 0, we are performing a loss animation. Upon reaching 0, we reset.
-byte lossAnimation = 0;
+BOARD_LOCAL byte lossAnimation = 0;
 
-void setup();
-void loop();
-void draw();
-void updateStrip();
 void h2rgb(float H, int &R, int &G, int &B);
+void assignColors();
 
 int get_max(int a, int b)
 {
@@ -79,6 +280,107 @@ int get_min(int a, int b)
   return a < b ? a : b;
 }
 
+// Expands ENTRY(0) to ENTRY(255), for lookup tables built by the compiler
+#define TABLE_4(ENTRY, i) ENTRY(i), ENTRY(i + 1), ENTRY(i + 2), ENTRY(i + 3)
+#define TABLE_16(ENTRY, i) TABLE_4(ENTRY, i), TABLE_4(ENTRY, i + 4), TABLE_4(ENTRY, i + 8), TABLE_4(ENTRY, i + 12)
+#define TABLE_64(ENTRY, i) TABLE_16(ENTRY, i), TABLE_16(ENTRY, i + 16), TABLE_16(ENTRY, i + 32), TABLE_16(ENTRY, i + 48)
+#define TABLE_256(ENTRY) TABLE_64(ENTRY, 0), TABLE_64(ENTRY, 64), TABLE_64(ENTRY, 128), TABLE_64(ENTRY, 192)
+#define TABLE_360(ENTRY) TABLE_256(ENTRY), TABLE_64(ENTRY, 256), TABLE_16(ENTRY, 320), TABLE_16(ENTRY, 336), \
+                         TABLE_4(ENTRY, 352), TABLE_4(ENTRY, 356)
+
+// Compile-time exp, log and pow for building tables. x must be positive for constexprLog().
+constexpr double constexprExpSeries(double x, int n, double term)
+{
+  return n > 20 ? term : term + constexprExpSeries(x, n + 1, term * x / n);
+}
+constexpr double constexprSquare(double x) { return x * x; }
+constexpr double constexprExp(double x)
+{
+  // exp(x) = exp(x / 16) ^ 16 keeps the series short
+  return x < -1 || x > 1 ? constexprSquare(constexprSquare(constexprSquare(constexprSquare(constexprExp(x / 16)))))
+                         : constexprExpSeries(x, 1, 1);
+}
+constexpr double constexprAtanhSeries(double z, double zSquared, int n)
+{
+  return n > 41 ? 0 : z / n + constexprAtanhSeries(z * zSquared, zSquared, n + 2);
+}
+constexpr double constexprLog(double x)
+{
+  // Halve or double into [0.5, 2], then ln(x) = 2 atanh((x - 1) / (x + 1))
+  return x < 0.5 ? constexprLog(x * 2) - 0.69314718055994531 : x > 2 ? constexprLog(x / 2) + 0.69314718055994531 : 2 * constexprAtanhSeries((x - 1) / (x + 1), ((x - 1) / (x + 1)) * ((x - 1) / (x + 1)), 1);
+}
+constexpr double constexprPow(double x, double y)
+{
+  return x <= 0 ? 0 : constexprExp(y * constexprLog(x));
+}
+
+// Colors are packed as 0xAARRGGBB. Alpha is only used by compositor layers, where 0 is transparent.
+typedef uint32_t Rgb;
+const Rgb TRANSPARENT = 0;
+
+inline Rgb packRgb(byte r, byte g, byte b, byte a = 255)
+{
+  return ((Rgb)a << 24) | ((Rgb)r << 16) | ((Rgb)g << 8) | b;
+}
+inline byte rgbRed(Rgb c) { return c >> 16; }
+inline byte rgbGreen(Rgb c) { return c >> 8; }
+inline byte rgbBlue(Rgb c) { return c; }
+inline byte rgbAlpha(Rgb c) { return c >> 24; }
+
+// h2rgb(hue / 360.0) for whole degrees, worked out by the compiler in the same float steps as h2rgb()
+// so every entry matches it exactly
+constexpr float huePosition(int hue) { return (float)(hue / 360.0) * 6; }
+constexpr int hueSector(int hue) { return (int)huePosition(hue); }
+constexpr float hueFall(int hue) { return 1 - (huePosition(hue) - hueSector(hue)); }
+constexpr float hueRise(int hue) { return 1 - (1 - (huePosition(hue) - hueSector(hue))); }
+constexpr byte hueLevel(float value) { return (int)((1 - value) * 255); }
+constexpr byte hueRed(int hue)
+{
+  return hueLevel(hueSector(hue) == 0 || hueSector(hue) == 5 ? 1 : hueSector(hue) == 1 ? hueFall(hue) : hueSector(hue) == 4 ? hueRise(hue) : 0);
+}
+constexpr byte hueGreen(int hue)
+{
+  return hueLevel(hueSector(hue) == 1 || hueSector(hue) == 2 ? 1 : hueSector(hue) == 0 ? hueRise(hue) : hueSector(hue) == 3 ? hueFall(hue) : 0);
+}
+constexpr byte hueBlue(int hue)
+{
+  return hueLevel(hueSector(hue) == 3 || hueSector(hue) == 4 ? 1 : hueSector(hue) == 2 ? hueRise(hue) : hueSector(hue) == 5 ? hueFall(hue) : 0);
+}
+#define HUE_ENTRY(i) {hueRed(i), hueGreen(i), hueBlue(i)}
+const byte hueTable[360][3] PROGMEM = {TABLE_360(HUE_ENTRY)};
+
+// hue is 0-359, or -1 for the dim color of an unlit line. Anything else is taken as -1 rather than read
+// from past the table.
+Rgb hueColor(int hue)
+{
+  if (hue < 0 || hue >= 360)
+    return packRgb(20, 20, 20);
+  const byte *entry = hueTable[hue];
+  return packRgb(progmemByte(entry), progmemByte(entry + 1), progmemByte(entry + 2));
+}
+
+// hueColor() the original way, for --equivalence
+Rgb referenceHueColor(int hue)
+{
+  if (hue == -1)
+    return packRgb(20, 20, 20);
+  int r = 0, g = 0, b = 0;
+  h2rgb(hue / 360.0, r, g, b);
+  return packRgb(r, g, b);
+}
+
+// Frames hold a gradient per line: entry 2 * i is the color at line i's start, 2 * i + 1 at its end
+inline void setLineGradient(Rgb *frame, byte line, Rgb start, Rgb end)
+{
+  frame[2 * line] = start;
+  frame[2 * line + 1] = end;
+}
+
+inline void setLineColor(Rgb *frame, byte line, Rgb color)
+{
+  setLineGradient(frame, line, color, color);
+}
+
 class Line
 {
   byte _id;
@@ -113,32 +415,15 @@ public:
   byte bottomY() { return get_max(_startY, _endY); }
   float centerX() { return _startX + (_endX - _startX) / 2.0; }
   float centerY() { return _startY + (_endY - _startY) / 2.0; }
-  int R()
-  {
-    if (_hue == -1)
-      return 20;
-    int r = 0, g = 0, b = 0;
-    h2rgb(_hue / 360.0, r, g, b);
-    return r;
-  }
-  int G()
-  {
-    if (_hue == -1)
-      return 20;
-    int r = 0, g = 0, b = 0;
-    h2rgb(_hue / 360.0, r, g, b);
-    return g;
-  }
-  int B()
-  {
-    if (_hue == -1)
-      return 20;
-    int r = 0, g = 0, b = 0;
-    h2rgb(_hue / 360.0, r, g, b);
-    return b;
-  }
+  Rgb color() { return hueColor(_hue); }
 };
 
+// Whether line a's end point is also one of line b's end points
+bool touchesAtEnd(Line *a, Line *b)
+{
+  return (a->endX() == b->startX() && a->endY() == b->startY()) || (a->endX() == b->endX() && a->endY() == b->endY());
+}
+
 // Returns 0-360 (0 is pointing to the right, 90 is up)
 float getAngle(float fromX, float fromY, float toX, float toY)
 {
@@ -148,6 +433,8 @@ float getAngle(float fromX, float fromY, float toX, float toY)
   return degrees;
 }
 
+// The reference snake body. RingQueue below replaces it in the game; this one is kept as the
+// behavior RingQueue is checked against by --equivalence.
 class Queue
 {
   static const byte MAXSIZE = 32;
@@ -182,6 +469,12 @@ public:
     return queue[0];
   }
 
+  // The i-th line from the tail
+  Line *at(byte i)
+  {
+    return queue[i];
+  }
+
   Line *popTail()
   {
     if (!isempty())
@@ -189,10 +482,11 @@ public:
       Line *tail = queue[0];
 
       // Shift every line back one into the newly freed up space
-      for (byte i = 0; i < _length; i++)
+      for (byte i = 0; i + 1 < _length; i++)
       {
         queue[i] = queue[i + 1];
       }
+      queue[_length - 1] = NULL;
       _length = _length - 1;
       return tail;
     }
@@ -229,564 +523,6798 @@ public:
   }
 };
 
-Line lines[32] = {
-    // Forward slash
-    Line(0, 1, 5, 2, 4), // Bottom left corner
-    Line(1, 2, 4, 3, 3),
-    Line(2, 3, 3, 4, 2),
-    Line(3, 4, 2, 5, 1),
-    Line(4, 5, 1, 6, 2),
-    Line(5, 6, 2, 5, 3),
-    Line(6, 5, 3, 4, 4),
-    Line(7, 4, 4, 3, 5),
-    Line(8, 3, 5, 2, 6),
-    Line(9, 2, 6, 1, 5),
-    Line(10, 1, 5, 0, 4),
-    Line(11, 0, 4, 1, 3),
-    Line(12, 1, 3, 2, 2),
-    Line(13, 2, 2, 3, 1),
-    Line(14, 3, 1, 4, 0),
-    Line(15, 4, 0, 5, 1),
-
-    // Backslash
-    Line(16, 1, 1, 2, 2), // Top left corner
-    Line(17, 2, 2, 3, 3),
-    Line(18, 3, 3, 4, 4),
-    Line(19, 4, 4, 5, 5),
-    Line(20, 5, 5, 4, 6),
-    Line(21, 4, 6, 3, 5),
-    Line(22, 3, 5, 2, 4),
-    Line(23, 2, 4, 1, 3),
-    Line(24, 1, 3, 0, 2),
-    Line(25, 0, 2, 1, 1),
-    Line(26, 1, 1, 2, 0),
-    Line(27, 2, 0, 3, 1),
-    Line(28, 3, 1, 4, 2),
-    Line(29, 4, 2, 5, 3),
-    Line(30, 5, 3, 6, 4),
-    Line(31, 6, 4, 5, 5),
-};
-
-Line *cherry = NULL;
-
-// Snake
-class Snake
+// Queue as a ring buffer: popping the tail moves an index instead of shifting every line, and a
+// count per line id makes contains() a lookup instead of a scan. Lines must have ids below MAXSIZE.
+class RingQueue
 {
+  static const byte MAXSIZE = 32;
+  Line *_lines[MAXSIZE] = {};
+  byte _counts[MAXSIZE] = {};
+  byte _tail = 0;
+  byte _length = 0;
+
 public:
-  Queue body;
-  byte length = 1;
-  Line *head()
+  byte getLength() { return _length; }
+  bool isempty() { return _length == 0; }
+  bool isfull() { return _length == MAXSIZE; }
+  void clear()
   {
-    return body.head();
+    _tail = 0;
+    _length = 0;
+    memset(_counts, 0, sizeof(_counts));
   }
-  // Which direction the snake is facing (i.e. where his head node is compared to his neck)
-  bool facingRight = true;
-  bool facingUp = true;
 
-  void grow()
-  {
-    length++;
-  }
-  void reset()
+  Line *head() { return _lines[(_tail + _length - 1) & (MAXSIZE - 1)]; }
+  Line *peekTail() { return _lines[_tail]; }
+  Line *at(byte i) { return _lines[(_tail + i) & (MAXSIZE - 1)]; }
+
+  Line *popTail()
   {
-    body.clear();
-    body.push(&lines[0]);
-    length = 1;
+    if (isempty())
+    {
+      return NULL;
+    }
+    Line *tail = _lines[_tail];
+    _counts[tail->id()]--;
+    _tail = (_tail + 1) & (MAXSIZE - 1);
+    _length--;
+    return tail;
   }
 
-  bool contains(Line *line)
+  void push(Line *data)
   {
-    return body.contains(line);
+    if (!isfull())
+    {
+      _lines[(_tail + _length) & (MAXSIZE - 1)] = data;
+      _counts[data->id()]++;
+      _length++;
+    }
   }
 
-  void move(int direction)
+  bool contains(Line *line) { return _counts[line->id()] > 0; }
+};
+
+// Returned in place of a sleep duration when a timeline task has finished
+const unsigned long TASK_DONE = 0xFFFFFFFF;
+
+// Timed tasks are written once with TIMELINE_TASK/TASK_BEGIN/TASK_SLEEP/TASK_END, as static members
+// of a class so they can be defined in any order. On the laptop they compile to C++20 coroutines. On
+// the micro they compile to a switch-based state machine, so state that must survive a TASK_SLEEP
+// has to live in globals rather than locals.
+#if defined(LAPTOP_MODE) && defined(__cpp_impl_coroutine)
+#define TIMELINE_COROUTINES
+#endif
+
+#ifdef TIMELINE_COROUTINES
+// Coroutine frames for timeline tasks: enough for every task slot plus one being started, so starting
+// a task doesn't allocate. A frame too big for a slot falls back to the heap.
+class TimelineFramePool
+{
+  static const byte FRAMES = 8;
+  static const size_t FRAME_SIZE = 512;
+  alignas(alignof(std::max_align_t)) byte _frames[FRAMES][FRAME_SIZE];
+  bool _used[FRAMES] = {};
+
+public:
+  void *allocate(size_t size)
   {
-    // Add a segment in the direction we're facing
-    Line *newHead = NULL;
-    if (facingRight)
+    for (byte i = 0; size <= FRAME_SIZE && i < FRAMES; i++)
     {
-      if (facingUp)
-      {
-        newHead = head()->rightNeighbors[direction];
-      }
-      else
+      if (!_used[i])
       {
-        newHead = head()->rightNeighbors[direction == LEFT ? RIGHT : (direction == RIGHT ? LEFT : STRAIGHT)];
+        _used[i] = true;
+        return _frames[i];
       }
     }
-    else
+    return ::operator new(size);
+  }
+
+  void release(void *frame)
+  {
+    for (byte i = 0; i < FRAMES; i++)
     {
-      if (facingUp)
-      {
-        newHead = head()->leftNeighbors[direction];
-      }
-      else
+      if (frame == _frames[i])
       {
-        newHead = head()->leftNeighbors[direction == LEFT ? RIGHT : (direction == RIGHT ? LEFT : STRAIGHT)];
+        _used[i] = false;
+        return;
       }
     }
+    ::operator delete(frame);
+  }
+};
 
-    // Set the new direction we're facing
-    // The neck is the segment that directly follows the head
-    Line *neck = body.queue[body.getLength() - 1];
-    if (facingRight)
-    {
-      // If we were previously facing right, we continue facing right if the left-most nodes don't match
-      facingRight = newHead->leftX() != neck->leftX();
-    }
-    else
-    {
-      // If we were previously facing left, we only switch to right if the left-most nodes match (we turned 90 degrees)
-      facingRight = newHead->leftX() == neck->leftX();
-    }
-    if (facingUp)
-    {
-      // If we were previously facing up, we continue facing up if the top-most nodes don't match
-      facingUp = newHead->topY() != neck->topY();
-    }
-    else
-    {
-      // If we were previously facing down, we only switch to up if the top-most nodes match (we turned 90 degrees)
-      facingUp = newHead->topY() == neck->topY();
-    }
+BOARD_LOCAL TimelineFramePool timelineFrames;
 
-    // Remove the last segment of the tail
-    if (body.getLength() >= length)
-    {
-      body.popTail();
-    }
+class TimelineTask
+{
+public:
+  struct promise_type
+  {
+    unsigned long sleepMs = TASK_DONE;
+    static void *operator new(size_t size) { return timelineFrames.allocate(size); }
+    static void operator delete(void *frame) { timelineFrames.release(frame); }
+    TimelineTask get_return_object() { return TimelineTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() { sleepMs = TASK_DONE; }
+    void unhandled_exception() {}
+  };
 
-    // Check for the lose condition
-    if (body.contains(newHead))
-    {
-      // Reset the loss animation. It will play over the next x ticks.
-      lossAnimation = 10;
-    }
-    else
+  TimelineTask() {}
+  TimelineTask(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+  // Runs the task until its next sleep. Returns how long it wants to sleep, or TASK_DONE.
+  unsigned long resume()
+  {
+    _handle.resume();
+    return _handle.done() ? TASK_DONE : _handle.promise().sleepMs;
+  }
+  void destroy()
+  {
+    if (_handle)
     {
-      // Add the new head
-      body.push(newHead);
+      _handle.destroy();
+      _handle = nullptr;
     }
   }
+
+private:
+  std::coroutine_handle<promise_type> _handle;
 };
 
-void initLine(byte index,
-              byte leftNeighborLeft, byte leftNeighborStraight, byte leftNeighborRight,
-              byte rightNeighborLeft, byte rightNeighborStraight, byte rightNeighborRight)
+struct TimelineSleep
 {
+  unsigned long ms;
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<TimelineTask::promise_type> handle) const noexcept { handle.promise().sleepMs = ms; }
+  void await_resume() const noexcept {}
+};
+
+#define TIMELINE_TASK(name) static TimelineTask name()
+#define TASK_BEGIN()
+#define TASK_SLEEP(ms) co_await TimelineSleep{(unsigned long)(ms)}
+#define TASK_END() co_return
+#else
+class TimelineTask
+{
+  unsigned long (*_step)(word &resumePoint) = NULL;
+  word _resumePoint = 0;
+
+public:
+  TimelineTask() {}
+  TimelineTask(unsigned long (*step)(word &resumePoint)) : _step(step) {}
+  unsigned long resume() { return _step(_resumePoint); }
+  void destroy() { _step = NULL; }
+};
+
+#define TIMELINE_TASK(name)                                        \
+  static TimelineTask name() { return TimelineTask(&name##Step); } \
+  static unsigned long name##Step(word &_resumePoint)
+#define TASK_BEGIN()        \
+  switch (_resumePoint)     \
+  {                         \
+  case 0:
+#define TASK_SLEEP(ms)            \
+  do                              \
+  {                               \
+    _resumePoint = __LINE__;      \
+    return (ms);                  \
+  case __LINE__:;                 \
+  } while (0)
+#define TASK_END() \
+  }                \
+  _resumePoint = 0; \
+  return TASK_DONE
+#endif
+
+// Cooperative scheduler for timed effects. run() is called once per loop() and resumes every task
+// whose sleep has elapsed, so nothing ever blocks the frame.
+class Timeline
+{
+  static const byte MAX_TASKS = 6;
+  TimelineTask _tasks[MAX_TASKS];
+  unsigned long _wakeAtMs[MAX_TASKS] = {};
+  bool _active[MAX_TASKS] = {};
+  unsigned long _nowMs = 0;
+
+public:
+  static const byte NO_TASK = 0xFF;
+
+  // Schedules a task to first run on the next call to run(). Returns its id, or NO_TASK when full.
+  byte start(TimelineTask task)
+  {
+    for (byte i = 0; i < MAX_TASKS; i++)
+    {
+      if (!_active[i])
+      {
+        _tasks[i] = task;
+        _wakeAtMs[i] = _nowMs;
+        _active[i] = true;
+        return i;
+      }
+    }
+    task.destroy();
+    return NO_TASK;
+  }
+
+  bool isRunning(byte id)
+  {
+    return id < MAX_TASKS && _active[id];
+  }
+
+  void cancel(byte id)
+  {
+    if (isRunning(id))
+    {
+      _tasks[id].destroy();
+      _active[id] = false;
+    }
+  }
+
+  void cancelAll()
+  {
+    for (byte i = 0; i < MAX_TASKS; i++)
+    {
+      cancel(i);
+    }
+  }
+
+  void run(unsigned long nowMs)
+  {
+    _nowMs = nowMs;
+    for (byte i = 0; i < MAX_TASKS; i++)
+    {
+      // Signed difference so this keeps working when millis() wraps
+      if (_active[i] && (long)(nowMs - _wakeAtMs[i]) >= 0)
+      {
+        unsigned long sleepMs = _tasks[i].resume();
+        if (sleepMs == TASK_DONE)
+        {
+          cancel(i);
+        }
+        else
+        {
+          _wakeAtMs[i] = nowMs + sleepMs;
+        }
+      }
+    }
+  }
+};
+
+BOARD_LOCAL Timeline timeline;
+
+// Trace log. Events are packed into fixed 6-byte records in a RAM ring buffer and sent out in the
+// background: by the UART's TX interrupt on the micro, by a thread writing a file on Linux. Nothing
+// waits on the port, so when the ring is full new records are dropped and counted instead.
+// A record is TRACE_SYNC, the event, a 16-bit argument and the low 16 bits of millis(), little-endian.
+// --decode-trace turns a capture back into text.
+const byte TRACE_SYNC = 0xA5;
+const byte TRACE_RECORD_SIZE = 6;
+const byte TRACE_TURN = 1;    // arg is LEFT or RIGHT
+const byte TRACE_ATE = 2;     // arg is the snake's new length
+const byte TRACE_LOST = 3;    // arg is the snake's length
+const byte TRACE_MODE = 4;    // arg is 1 for rainbow, 0 for snake
+const byte TRACE_DROPPED = 5; // arg is how many records didn't fit
+const long TRACE_BAUD = 115200;
+
+class TraceLog
+{
+#ifdef __AVR__
+  static const byte CAPACITY = 128;
+  // The head is only written by loop() and the tail only by the TX interrupt. Single bytes, so reads
+  // and writes of them are atomic.
+  volatile byte _head = 0;
+  volatile byte _tail = 0;
+#else
+  static const word CAPACITY = 4096;
+  std::atomic<word> _head{0};
+  std::atomic<word> _tail{0};
+  FILE *_file = NULL;
+  std::thread _drainer;
+  std::atomic<bool> _running{false};
+#endif
+  byte _buffer[CAPACITY];
+  word _dropped = 0;
+
+  void put(word &head, byte value)
+  {
+    _buffer[head] = value;
+    head = (head + 1) & (CAPACITY - 1);
+  }
+
+  void write(word head, byte event, word arg, word ms)
+  {
+    put(head, TRACE_SYNC);
+    put(head, event);
+    put(head, arg);
+    put(head, arg >> 8);
+    put(head, ms);
+    put(head, ms >> 8);
+    // Publish the record only once it's complete
+#ifdef __AVR__
+    _head = head;
+#else
+    _head.store(head, std::memory_order_release);
+#endif
+  }
+
+#ifndef __AVR__
+  void drain()
+  {
+    int value;
+    while ((value = next()) >= 0)
+    {
+      fputc(value, _file);
+    }
+    fflush(_file);
+  }
+#endif
+
+public:
+#ifdef __AVR__
+  void begin()
+  {
+    // 8N1 at double speed, which gets closest to TRACE_BAUD at 16 MHz
+    UCSR0A = _BV(U2X0);
+    UBRR0 = F_CPU / 8 / TRACE_BAUD - 1;
+    UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+    UCSR0B = _BV(TXEN0);
+  }
+#else
+  // Starts writing records to file from a background thread
+  void begin(FILE *file)
+  {
+    if (_running || file == NULL)
+    {
+      return;
+    }
+    _file = file;
+    _running = true;
+    _drainer = std::thread([this]() {
+      while (_running)
+      {
+        drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      drain();
+    });
+  }
+
+  void end()
+  {
+    if (_running)
+    {
+      _running = false;
+      _drainer.join();
+      fclose(_file);
+    }
+  }
+  ~TraceLog() { end(); }
+#endif
+
+  // Queues a record. Never blocks: if the ring is full the record is dropped.
+  void record(byte event, word arg, word ms)
+  {
+#ifdef MOCK_MICRO
+    mockSpend(mockCosts.trace, mockCoreCycles);
+#endif
+#ifdef __AVR__
+    word head = _head;
+    word tail = _tail;
+#else
+    if (!_running)
+    {
+      return;
+    }
+    word head = _head.load(std::memory_order_relaxed);
+    word tail = _tail.load(std::memory_order_acquire);
+#endif
+    word free = (tail - head - 1) & (CAPACITY - 1);
+    if (_dropped > 0 && free >= 2 * TRACE_RECORD_SIZE)
+    {
+      write(head, TRACE_DROPPED, _dropped, ms);
+      head = (head + TRACE_RECORD_SIZE) & (CAPACITY - 1);
+      free -= TRACE_RECORD_SIZE;
+      _dropped = 0;
+    }
+    if (free < TRACE_RECORD_SIZE)
+    {
+      _dropped++;
+      return;
+    }
+    write(head, event, arg, ms);
+#ifdef __AVR__
+    // Wake the TX interrupt, which turns itself off once the ring is empty
+    UCSR0B |= _BV(UDRIE0);
+#endif
+  }
+
+  // Takes the next byte to send, or returns -1 when there is none
+  int next()
+  {
+#ifdef __AVR__
+    byte tail = _tail;
+    if (tail == _head)
+    {
+      return -1;
+    }
+    byte value = _buffer[tail];
+    _tail = (tail + 1) & (CAPACITY - 1);
+#else
+    word tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head.load(std::memory_order_acquire))
+    {
+      return -1;
+    }
+    byte value = _buffer[tail];
+    _tail.store((tail + 1) & (CAPACITY - 1), std::memory_order_release);
+#endif
+    return value;
+  }
+};
+
+TraceLog traceLog;
+
+#ifdef __AVR__
+ISR(USART_UDRE_vect)
+{
+  int value = traceLog.next();
+  if (value < 0)
+  {
+    UCSR0B &= ~_BV(UDRIE0);
+  }
+  else
+  {
+    UDR0 = value;
+  }
+}
+#endif
+
+// Profiler for the laptop build, compiled in with -DPROFILE. PROFILE_SCOPE times the rest of the
+// enclosing block and PROFILE_INSTANT marks a moment. Each thread records into its own ring of the
+// most recent events without locking, and writeProfile() saves them as Chrome trace_event JSON for
+// Perfetto or chrome://tracing. Without PROFILE both macros compile to nothing.
+#if defined(LAPTOP_MODE) && defined(PROFILE)
+#include <mutex>
+struct ProfileEvent
+{
+  const char *name;
+  uint64_t startNs;
+  uint64_t durationNs; // Unused by instants
+  int arg;
+  char phase; // 'X' for a span, 'i' for an instant
+};
+
+// One thread's events. Only that thread writes; writeProfile() reads up to the published count.
+struct ProfileBuffer
+{
+  static const size_t CAPACITY = 1 << 16;
+  ProfileEvent events[CAPACITY];
+  std::atomic<uint64_t> count{0};
+  int threadId;
+
+  void add(const ProfileEvent &event)
+  {
+    uint64_t n = count.load(std::memory_order_relaxed);
+    events[n & (CAPACITY - 1)] = event;
+    count.store(n + 1, std::memory_order_release);
+  }
+};
+
+class Profiler
+{
+  std::mutex _mutex;
+  std::vector<ProfileBuffer *> _buffers;
+  std::chrono::steady_clock::time_point _origin = std::chrono::steady_clock::now();
+
+  // Only taken once per thread, the first time it records
+  ProfileBuffer *registerThread()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ProfileBuffer *buffer = new ProfileBuffer();
+    buffer->threadId = _buffers.size() + 1;
+    _buffers.push_back(buffer);
+    return buffer;
+  }
+
+public:
+  ProfileBuffer &threadBuffer()
+  {
+    thread_local ProfileBuffer *buffer = registerThread();
+    return *buffer;
+  }
+
+  uint64_t nowNs()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _origin).count();
+  }
+
+  void instant(const char *name, int arg)
+  {
+    threadBuffer().add({name, nowNs(), 0, arg, 'i'});
+  }
+
+  bool write(const char *path)
+  {
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+      perror(path);
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *separator = "";
+    for (ProfileBuffer *buffer : _buffers)
+    {
+      uint64_t count = buffer->count.load(std::memory_order_acquire);
+      uint64_t first = count > ProfileBuffer::CAPACITY ? count - ProfileBuffer::CAPACITY : 0;
+      for (uint64_t n = first; n < count; n++)
+      {
+        const ProfileEvent &event = buffer->events[n & (ProfileBuffer::CAPACITY - 1)];
+        fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", separator, event.name,
+                event.phase, buffer->threadId, event.startNs / 1000.0);
+        if (event.phase == 'X')
+          fprintf(file, ",\"dur\":%.3f}", event.durationNs / 1000.0);
+        else
+          fprintf(file, ",\"s\":\"t\",\"args\":{\"value\":%d}}", event.arg);
+        separator = ",\n";
+      }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+  }
+};
+Profiler profiler;
+
+class ProfileScope
+{
+  const char *_name;
+  uint64_t _startNs;
+
+public:
+  ProfileScope(const char *name) : _name(name), _startNs(profiler.nowNs()) {}
+  ~ProfileScope() { profiler.threadBuffer().add({_name, _startNs, profiler.nowNs() - _startNs, 0, 'X'}); }
+};
+
+#define PROFILE_CONCAT(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_CONCAT(profileScope, line)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_NAME(__LINE__)(name)
+#define PROFILE_INSTANT(name, arg) profiler.instant(name, arg)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_INSTANT(name, arg)
+#endif
+
+Line lines[32] = {
+    // Forward slash
+    Line(0, 1, 5, 2, 4), // Bottom left corner
+    Line(1, 2, 4, 3, 3),
+    Line(2, 3, 3, 4, 2),
+    Line(3, 4, 2, 5, 1),
+    Line(4, 5, 1, 6, 2),
+    Line(5, 6, 2, 5, 3),
+    Line(6, 5, 3, 4, 4),
+    Line(7, 4, 4, 3, 5),
+    Line(8, 3, 5, 2, 6),
+    Line(9, 2, 6, 1, 5),
+    Line(10, 1, 5, 0, 4),
+    Line(11, 0, 4, 1, 3),
+    Line(12, 1, 3, 2, 2),
+    Line(13, 2, 2, 3, 1),
+    Line(14, 3, 1, 4, 0),
+    Line(15, 4, 0, 5, 1),
+
+    // Backslash
+    Line(16, 1, 1, 2, 2), // Top left corner
+    Line(17, 2, 2, 3, 3),
+    Line(18, 3, 3, 4, 4),
+    Line(19, 4, 4, 5, 5),
+    Line(20, 5, 5, 4, 6),
+    Line(21, 4, 6, 3, 5),
+    Line(22, 3, 5, 2, 4),
+    Line(23, 2, 4, 1, 3),
+    Line(24, 1, 3, 0, 2),
+    Line(25, 0, 2, 1, 1),
+    Line(26, 1, 1, 2, 0),
+    Line(27, 2, 0, 3, 1),
+    Line(28, 3, 1, 4, 2),
+    Line(29, 4, 2, 5, 3),
+    Line(30, 5, 3, 6, 4),
+    Line(31, 6, 4, 5, 5),
+};
+
+BOARD_LOCAL Line *cherry = NULL;
+BOARD_LOCAL bool cherryVisible = true;
+
+// The original snake, kept as the rules Snake below is built from and checked against by
+// --equivalence
+class ReferenceSnake
+{
+public:
+  Queue body;
+  byte length = 1;
+  Line *head()
+  {
+    return body.head();
+  }
+  // Which direction the snake is facing (i.e. where his head node is compared to his neck)
+  bool facingRight = true;
+  bool facingUp = true;
+
+  void grow()
+  {
+    length++;
+  }
+  void reset()
+  {
+    body.clear();
+    body.push(&lines[0]);
+    length = 1;
+  }
+
+  bool contains(Line *line)
+  {
+    return body.contains(line);
+  }
+
+  void move(int direction)
+  {
+    // Add a segment in the direction we're facing
+    Line *newHead = NULL;
+    if (facingRight)
+    {
+      if (facingUp)
+      {
+        newHead = head()->rightNeighbors[direction];
+      }
+      else
+      {
+        newHead = head()->rightNeighbors[direction == LEFT ? RIGHT : (direction == RIGHT ? LEFT : STRAIGHT)];
+      }
+    }
+    else
+    {
+      if (facingUp)
+      {
+        newHead = head()->leftNeighbors[direction];
+      }
+      else
+      {
+        newHead = head()->leftNeighbors[direction == LEFT ? RIGHT : (direction == RIGHT ? LEFT : STRAIGHT)];
+      }
+    }
+
+    // Set the new direction we're facing
+    // The neck is the segment that directly follows the head
+    Line *neck = body.queue[body.getLength() - 1];
+    if (facingRight)
+    {
+      // If we were previously facing right, we continue facing right if the left-most nodes don't match
+      facingRight = newHead->leftX() != neck->leftX();
+    }
+    else
+    {
+      // If we were previously facing left, we only switch to right if the left-most nodes match (we turned 90 degrees)
+      facingRight = newHead->leftX() == neck->leftX();
+    }
+    if (facingUp)
+    {
+      // If we were previously facing up, we continue facing up if the top-most nodes don't match
+      facingUp = newHead->topY() != neck->topY();
+    }
+    else
+    {
+      // If we were previously facing down, we only switch to up if the top-most nodes match (we turned 90 degrees)
+      facingUp = newHead->topY() == neck->topY();
+    }
+
+    // Remove the last segment of the tail
+    if (body.getLength() >= length)
+    {
+      body.popTail();
+    }
+
+    // Check for the lose condition
+    if (body.contains(newHead))
+    {
+      // Reset the loss animation. It will play over the next x ticks.
+      lossAnimation = 10;
+    }
+    else
+    {
+      // Add the new head
+      body.push(newHead);
+    }
+  }
+};
+
+// Where the head goes next for every (line * 4 + facing) * 3 + action, packed as the line << 2 | the
+// way it faces afterwards (bit 0 is facingRight, bit 1 is facingUp). One byte an entry, as RAM on the
+// micro is short. Filled in by initLines() from ReferenceSnake::move(), whose result only depends on
+// the head, the facing and the action.
+byte snakeNext[32 * 4 * 3];
+
+// Snake. Moves are table lookups instead of neighbor and position comparisons, and the body is a
+// RingQueue. Body is the queue of lines it covers, from tail to head.
+class Snake
+{
+public:
+  RingQueue body;
+  byte length = 1;
+  Line *head()
+  {
+    return body.head();
+  }
+  // Which direction the snake is facing (i.e. where his head node is compared to his neck)
+  bool facingRight = true;
+  bool facingUp = true;
+
+  void grow()
+  {
+    length++;
+  }
+  void reset()
+  {
+    body.clear();
+    body.push(&lines[0]);
+    length = 1;
+  }
+
+  bool contains(Line *line)
+  {
+    return body.contains(line);
+  }
+
+  void move(int direction)
+  {
+    int index = (head()->id() * 4 + (facingRight ? 1 : 0) + (facingUp ? 2 : 0)) * 3 + direction;
+    byte next = snakeNext[index];
+    Line *newHead = &lines[next >> 2];
+    facingRight = next & 1;
+    facingUp = next & 2;
+
+    // Remove the last segment of the tail
+    if (body.getLength() >= length)
+    {
+      body.popTail();
+    }
+
+    // Check for the lose condition
+    if (body.contains(newHead))
+    {
+      // Reset the loss animation. It will play over the next x ticks.
+      lossAnimation = 10;
+    }
+    else
+    {
+      // Add the new head
+      body.push(newHead);
+    }
+  }
+};
+
+void initLine(byte index,
+              byte leftNeighborLeft, byte leftNeighborStraight, byte leftNeighborRight,
+              byte rightNeighborLeft, byte rightNeighborStraight, byte rightNeighborRight)
+{
+
+  lines[index].leftNeighbors[LEFT] = &lines[leftNeighborLeft];
+  lines[index].leftNeighbors[STRAIGHT] = &lines[leftNeighborStraight];
+  lines[index].leftNeighbors[RIGHT] = &lines[leftNeighborRight];
+  lines[index].rightNeighbors[LEFT] = &lines[rightNeighborLeft];
+  lines[index].rightNeighbors[STRAIGHT] = &lines[rightNeighborStraight];
+  lines[index].rightNeighbors[RIGHT] = &lines[rightNeighborRight];
+}
+
+void initLines()
+{
+  initLine(0, 10, 9, 9, 23, 1, 22);
+  initLine(1, 23, 0, 22, 17, 2, 18);
+  initLine(2, 17, 1, 18, 28, 3, 29);
+  initLine(3, 28, 2, 29, 15, 15, 4);
+  initLine(4, 3, 15, 15, 5, 5, 5);
+  initLine(5, 29, 6, 30, 4, 4, 4);
+  initLine(6, 18, 7, 19, 29, 5, 30);
+  initLine(7, 22, 8, 21, 18, 6, 19);
+  initLine(8, 9, 9, 9, 22, 7, 21);
+  initLine(9, 10, 10, 0, 8, 8, 8);
+  initLine(10, 11, 11, 11, 9, 9, 0);
+  initLine(11, 10, 10, 10, 24, 12, 23);
+  initLine(12, 24, 11, 23, 16, 13, 17);
+  initLine(13, 16, 12, 17, 27, 14, 28);
+  initLine(14, 27, 13, 28, 15, 15, 15);
+  initLine(15, 14, 14, 14, 3, 4, 4);
+  initLine(16, 25, 25, 26, 12, 17, 13);
+  initLine(17, 12, 16, 13, 1, 18, 2);
+  initLine(18, 1, 17, 2, 7, 19, 6);
+  initLine(19, 7, 18, 6, 20, 31, 31);
+  initLine(20, 21, 21, 21, 19, 31, 31);
+  initLine(21, 8, 22, 7, 20, 20, 20);
+  initLine(22, 0, 23, 1, 8, 21, 7);
+  initLine(23, 11, 24, 12, 0, 22, 1);
+  initLine(24, 25, 25, 25, 11, 23, 12);
+  initLine(25, 24, 24, 24, 26, 26, 16);
+  initLine(26, 25, 25, 16, 27, 27, 27);
+  initLine(27, 26, 26, 26, 13, 28, 14);
+  initLine(28, 13, 27, 14, 2, 29, 3);
+  initLine(29, 2, 28, 3, 6, 30, 5);
+  initLine(30, 6, 29, 5, 31, 31, 31);
+  initLine(31, 19, 20, 20, 30, 30, 30);
+
+  // Walk every (line, facing, action) through the reference rules once
+  byte savedLossAnimation = lossAnimation;
+  for (byte i = 0; i < sizeof(lines) / sizeof(Line); i++)
+  {
+    for (byte facing = 0; facing < 4; facing++)
+    {
+      for (byte action = 0; action < 3; action++)
+      {
+        ReferenceSnake snake;
+        snake.body.push(&lines[i]);
+        snake.length = 2;
+        snake.facingRight = facing & 1;
+        snake.facingUp = facing & 2;
+        snake.move(action);
+        int index = (i * 4 + facing) * 3 + action;
+        snakeNext[index] = snake.head()->id() << 2 | (snake.facingRight ? 1 : 0) | (snake.facingUp ? 2 : 0);
+      }
+    }
+  }
+  lossAnimation = savedLossAnimation;
+}
+
+BOARD_LOCAL Snake snake;
+
+#ifdef LAPTOP_MODE
+// How many of lines[] the board uses. A layout loaded with --layout can use fewer.
+byte activeLineCount = sizeof(lines) / sizeof(Line);
+#endif
+
+byte lineCount()
+{
+#ifdef LAPTOP_MODE
+  return activeLineCount;
+#else
+  return sizeof(lines) / sizeof(Line);
+#endif
+}
+// The strip layout compiled into transmit order. LEDs that aren't on any line point at the blank
+// entry after the last line, so the output stage never has to check.
+byte stripLedLine[LED_COUNT];
+// Where each LED's center sits along its line, from 0 at the line's start to 255 at its end
+byte stripLedPosition[LED_COUNT];
+// How many LEDs each line has
+byte lineLedCount[32];
+
+void compileStripLayout(const StripRun *runs, byte runCount)
+{
+  memset(stripLedLine, lineCount(), sizeof(stripLedLine));
+  memset(stripLedPosition, 0, sizeof(stripLedPosition));
+  memset(lineLedCount, 0, sizeof(lineLedCount));
+  for (byte r = 0; r < runCount; r++)
+  {
+    StripRun run = runs[r];
+    for (byte l = 0; l < run.lineCount; l++)
+    {
+      byte line = run.firstLine + l;
+      bool backwards = run.reversed != (run.serpentine && (l & 1));
+      for (byte k = 0; k < run.ledsPerLine; k++)
+      {
+        int led = run.firstLed + l * run.ledsPerLine + k;
+        if (led >= LED_COUNT || line >= lineCount())
+        {
+          continue;
+        }
+        byte along = backwards ? run.ledsPerLine - 1 - k : k;
+        stripLedLine[led] = line;
+        stripLedPosition[led] = (along * 2 + 1) * 128 / run.ledsPerLine;
+        lineLedCount[line]++;
+      }
+    }
+  }
+}
+
+#ifdef LAPTOP_MODE
+// Board layouts for --layout, so a new installation shape needs a file rather than a rebuild. Written
+// by --compile-layout from a text description. The file is mapped and used where it lies: every
+// section is a flat array at an aligned offset, lines refer to each other by index rather than by
+// pointer, and checking it is one pass over those arrays, so thirty thousand lines load about as
+// quickly as thirty. Little-endian:
+//   LayoutHeader
+//   LayoutLine[lineCount]            where each line runs, in grid units
+//   uint32_t[lineCount * 4 * 3]      the transitions: for each directed line (line * 4 + facing, as in
+//                                    snakeNext) and action, the next line << 2 | its facing
+//   uint32_t[ledCount]               for each LED in transmit order, its line << 8 | its position along
+//                                    the line, as in stripLedPosition. LEDs on no line have line lineCount.
+const uint32_t LAYOUT_MAGIC = 0x594C4C50; // "PLLY"
+const uint16_t LAYOUT_VERSION = 1;
+// Indexes have to leave room for the facing and position packed beside them
+const uint32_t LAYOUT_MAX_LINES = 1 << 24;
+// The grid the effects and the preview place lines on
+const uint16_t LAYOUT_GRID = 6;
+
+struct LayoutHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t headerBytes; // sizeof(LayoutHeader), so later versions can grow it
+  uint32_t lineCount;
+  uint32_t ledCount;
+  uint32_t linesOffset; // Byte offsets of the sections from the start of the file
+  uint32_t transitionsOffset;
+  uint32_t ledsOffset;
+  uint32_t fileBytes;
+};
+
+struct LayoutLine
+{
+  uint16_t startX;
+  uint16_t startY;
+  uint16_t endX;
+  uint16_t endY;
+};
+
+// The sections of a checked layout, pointing into it
+struct LayoutView
+{
+  const LayoutHeader *header;
+  const LayoutLine *lines;
+  const uint32_t *transitions;
+  const uint32_t *leds;
+};
+
+// Whether a section of count items of itemBytes each, at offset, lies within a file of fileBytes
+bool layoutSectionFits(uint32_t offset, uint32_t count, uint32_t itemBytes, uint32_t fileBytes)
+{
+  return offset % 4 == 0 && offset <= fileBytes && (fileBytes - offset) / itemBytes >= count;
+}
+
+// Says what is wrong with the layout at path, unless path is NULL, and returns false
+bool layoutInvalid(const char *path, const char *format, ...)
+{
+  if (path != NULL)
+  {
+    fprintf(stderr, "%s: ", path);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+  }
+  return false;
+}
+
+// Checks a layout where it lies, without copying it, and points view at its sections
+bool validateLayout(const byte *data, size_t size, LayoutView &view, const char *path)
+{
+  const LayoutHeader *header = (const LayoutHeader *)data;
+  if (size < sizeof(LayoutHeader) || header->magic != LAYOUT_MAGIC)
+  {
+    return layoutInvalid(path, "not a layout");
+  }
+  if (header->version != LAYOUT_VERSION || header->headerBytes != sizeof(LayoutHeader))
+  {
+    return layoutInvalid(path, "layout version %u, but this build reads %u", header->version, LAYOUT_VERSION);
+  }
+  uint32_t lineCount = header->lineCount;
+  if (header->fileBytes != size || lineCount == 0 || lineCount >= LAYOUT_MAX_LINES ||
+      !layoutSectionFits(header->linesOffset, lineCount, sizeof(LayoutLine), size) ||
+      !layoutSectionFits(header->transitionsOffset, lineCount * 4 * 3, sizeof(uint32_t), size) ||
+      !layoutSectionFits(header->ledsOffset, header->ledCount, sizeof(uint32_t), size))
+  {
+    return layoutInvalid(path, "sections don't fit in the file; it may be cut short");
+  }
+  view.header = header;
+  view.lines = (const LayoutLine *)(data + header->linesOffset);
+  view.transitions = (const uint32_t *)(data + header->transitionsOffset);
+  view.leds = (const uint32_t *)(data + header->ledsOffset);
+
+  // Every index has to land on a line
+  for (uint32_t i = 0; i < lineCount * 4 * 3; i++)
+  {
+    if (view.transitions[i] >> 2 >= lineCount)
+    {
+      return layoutInvalid(path, "line %u's transitions lead off the board", i / 12);
+    }
+  }
+  for (uint32_t i = 0; i < header->ledCount; i++)
+  {
+    if (view.leds[i] >> 8 > lineCount)
+    {
+      return layoutInvalid(path, "LED %u is on a line that doesn't exist", i);
+    }
+  }
+  return true;
+}
+
+// Whether the game, built for at most 32 lines of LED_COUNT LEDs on its grid, can play a layout.
+// Reasons it can't are printed after what.
+bool layoutFitsGame(const LayoutView &view, const char *what)
+{
+  if (view.header->lineCount > sizeof(lines) / sizeof(Line) || view.header->ledCount > LED_COUNT)
+  {
+    fprintf(stderr, "%s: %u lines and %u LEDs, but this build plays at most %u lines and %d LEDs\n", what,
+            view.header->lineCount, view.header->ledCount, (unsigned)(sizeof(lines) / sizeof(Line)), LED_COUNT);
+    return false;
+  }
+  for (uint32_t i = 0; i < view.header->lineCount; i++)
+  {
+    const LayoutLine &l = view.lines[i];
+    if (get_max(get_max(l.startX, l.startY), get_max(l.endX, l.endY)) > LAYOUT_GRID)
+    {
+      fprintf(stderr, "%s: line %u is off the %d by %d grid\n", what, i, LAYOUT_GRID, LAYOUT_GRID);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Everything a layout decides about the board, worked out ahead of time so that switching boards is a
+// copy: the lines, the snake's transition tables and the compiled strip
+struct BoardTables
+{
+  byte lineCount;
+  Line lines[32];
+  byte next[sizeof(snakeNext)];
+  byte ledLine[LED_COUNT];
+  byte ledPosition[LED_COUNT];
+  byte lineLedCount[32];
+};
+
+// Works out the tables for a layout that fits the game
+void layoutBoardTables(const LayoutView &view, BoardTables &board)
+{
+  board.lineCount = view.header->lineCount;
+  for (byte i = 0; i < board.lineCount; i++)
+  {
+    const LayoutLine &l = view.lines[i];
+    board.lines[i] = Line(i, l.startX, l.startY, l.endX, l.endY);
+  }
+  // Packed the same way as snakeNext
+  memset(board.next, 0, sizeof(board.next));
+  for (int i = 0; i < board.lineCount * 4 * 3; i++)
+  {
+    board.next[i] = view.transitions[i];
+  }
+  memset(board.ledLine, board.lineCount, sizeof(board.ledLine));
+  memset(board.ledPosition, 0, sizeof(board.ledPosition));
+  memset(board.lineLedCount, 0, sizeof(board.lineLedCount));
+  for (uint32_t led = 0; led < view.header->ledCount; led++)
+  {
+    byte line = view.leds[led] >> 8;
+    board.ledLine[led] = line;
+    board.ledPosition[led] = view.leds[led] & 0xFF;
+    if (line < board.lineCount)
+    {
+      board.lineLedCount[line]++;
+    }
+  }
+}
+
+// The current board's tables
+void readBoardTables(BoardTables &board)
+{
+  board.lineCount = lineCount();
+  std::copy(lines, lines + lineCount(), board.lines);
+  memcpy(board.next, snakeNext, sizeof(board.next));
+  memcpy(board.ledLine, stripLedLine, sizeof(board.ledLine));
+  memcpy(board.ledPosition, stripLedPosition, sizeof(board.ledPosition));
+  memcpy(board.lineLedCount, lineLedCount, sizeof(board.lineLedCount));
+}
+
+// Makes board the current board
+void useBoardTables(const BoardTables &board)
+{
+  activeLineCount = board.lineCount;
+  std::copy(board.lines, board.lines + board.lineCount, lines);
+  memcpy(snakeNext, board.next, sizeof(snakeNext));
+  memcpy(stripLedLine, board.ledLine, sizeof(stripLedLine));
+  memcpy(stripLedPosition, board.ledPosition, sizeof(stripLedPosition));
+  memcpy(lineLedCount, board.lineLedCount, sizeof(lineLedCount));
+}
+
+// Makes a layout that fits the game the board
+void applyLayout(const LayoutView &view)
+{
+  BoardTables board;
+  layoutBoardTables(view, board);
+  useBoardTables(board);
+}
+
+// The layout file given with --layout, mapped for as long as the game runs
+class MappedLayout
+{
+  void *_data = NULL;
+  size_t _size = 0;
+  LayoutView _view = {};
+
+public:
+  ~MappedLayout() { close(); }
+
+  bool open(const char *path)
+  {
+    close();
+    int fd = ::open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+      perror(path);
+      if (fd >= 0)
+      {
+        ::close(fd);
+      }
+      return false;
+    }
+    void *data = info.st_size == 0 ? MAP_FAILED : mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+      fprintf(stderr, "%s: can't be mapped\n", path);
+      return false;
+    }
+    _data = data;
+    _size = info.st_size;
+    if (!validateLayout((const byte *)_data, _size, _view, path) || !layoutFitsGame(_view, path))
+    {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close()
+  {
+    if (_data != NULL)
+    {
+      munmap(_data, _size);
+      _data = NULL;
+    }
+  }
+
+  const LayoutView &view() { return _view; }
+
+  // Replaces the built-in board, when a layout is open
+  bool apply()
+  {
+    if (_data == NULL)
+    {
+      return false;
+    }
+    applyLayout(_view);
+    return true;
+  }
+};
+
+MappedLayout mappedLayout;
+
+BOARD_LOCAL byte stripPixels[LED_COUNT * 3];
+#endif
+
+// The buffer the strip is sent from, 3 bytes per LED in transmit order
+byte *stripBuffer()
+{
+#ifdef MICRO_MODE
+  return strip.getPixels();
+#else
+  return stripPixels;
+#endif
+}
+
+// Random number policies for Platform. random(low, high) picks from low to high - 1, like Arduino's.
+struct LibcRandom
+{
+  static void begin() {}
+  static long random(long low, long high) { return low + rand() % (high - low); }
+};
+
+#ifdef MICRO_MODE
+struct ArduinoRandom
+{
+  static void begin() { randomSeed(analogRead(A4)); }
+  static long random(long low, long high) { return ::random(low, high); }
+};
+typedef ArduinoRandom DefaultRandom;
+#else
+typedef LibcRandom DefaultRandom;
+#endif
+
+template <class Random = DefaultRandom>
+int getRandomLineIndex()
+{
+  return Random::random(0, lineCount());
+}
+
+template <class Random = DefaultRandom>
+int getRandomHue()
+{
+  return Random::random(0, 360);
+}
+
+template <class Random = DefaultRandom>
+void randomizeCherry()
+{
+  cherry = &lines[getRandomLineIndex<Random>()];
+  while (snake.contains(cherry))
+  {
+    cherry = &lines[getRandomLineIndex<Random>()];
+  }
+}
+
+void randomizeColors()
+{
+  for (int i = 0; i < lineCount(); i++)
+  {
+    lines[i].setHue(getRandomHue<>());
+  }
+}
+
+BOARD_LOCAL bool clockwiseRainbow = true;
+
+// centerX and centerY are 0-1. hueOffset is from 0-360
+void colorWheel(float centerX, float centerY, float hueOffset)
+{
+  // Normalize center. Line center is 3,3, far corner is 6,6.
+  centerX = centerX * 6;
+  centerY = centerY * 6;
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    // angle will be between 0 and 360
+    float angle = getAngle(centerX, centerY, lines[i].centerX(), lines[i].centerY());
+    float hue = fmod(360 + angle - hueOffset, 360);
+    lines[i].setHue(hue);
+  }
+}
+
+// Whether a line end sits on the wheel's center, where it has no angle of its own. The rest of a line
+// running out from the center is all at the other end's angle, so that end's hue is used for both.
+inline bool onWheelCenter(byte x, byte y, float centerX, float centerY)
+{
+  return fabsf(x - centerX) < 0.001f && fabsf(y - centerY) < 0.001f;
+}
+
+// colorWheel() sampled at both ends of every line, so each line is a gradient around the wheel. The
+// original version, which the optimized one below is checked against by --equivalence.
+void referenceColorWheelGradient(Rgb *frame, float centerX, float centerY, float hueOffset)
+{
+  centerX = centerX * 6;
+  centerY = centerY * 6;
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    float startAngle = getAngle(centerX, centerY, lines[i].startX(), lines[i].startY());
+    float endAngle = getAngle(centerX, centerY, lines[i].endX(), lines[i].endY());
+    if (onWheelCenter(lines[i].startX(), lines[i].startY(), centerX, centerY))
+    {
+      startAngle = endAngle;
+    }
+    else if (onWheelCenter(lines[i].endX(), lines[i].endY(), centerX, centerY))
+    {
+      endAngle = startAngle;
+    }
+    setLineGradient(frame, i,
+                    referenceHueColor(fmod(360 + startAngle - hueOffset, 360)),
+                    referenceHueColor(fmod(360 + endAngle - hueOffset, 360)));
+  }
+}
+
+// Build with -DFAST_WHEEL for the vectorized color wheel below. It is several times faster, but its
+// approximate angle can shift colors by a few levels, so the exact one is the default.
+#if defined(LAPTOP_MODE) && defined(__SSE2__) && defined(FAST_WHEEL)
+inline __m128 selectPs(__m128 mask, __m128 ifTrue, __m128 ifFalse)
+{
+  return _mm_or_ps(_mm_and_ps(mask, ifTrue), _mm_andnot_ps(mask, ifFalse));
+}
+
+// getAngle() for four points at once: the angle of (x, y) from 0 to 360 degrees. atan() is
+// approximated by a polynomial good to about 0.001 degrees.
+inline __m128 angleDegrees4(__m128 x, __m128 y)
+{
+  const __m128 signMask = _mm_set1_ps(-0.0f);
+  __m128 absX = _mm_andnot_ps(signMask, x);
+  __m128 absY = _mm_andnot_ps(signMask, y);
+  __m128 ratio = _mm_div_ps(_mm_min_ps(absX, absY), _mm_max_ps(_mm_max_ps(absX, absY), _mm_set1_ps(1e-30f)));
+  __m128 square = _mm_mul_ps(ratio, ratio);
+  __m128 angle = _mm_add_ps(_mm_mul_ps(square, _mm_set1_ps(-0.0464964749f)), _mm_set1_ps(0.15931422f));
+  angle = _mm_add_ps(_mm_mul_ps(angle, square), _mm_set1_ps(-0.327622764f));
+  angle = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(angle, square), ratio), ratio);
+  // Unfold from the first octant
+  angle = selectPs(_mm_cmpgt_ps(absY, absX), _mm_sub_ps(_mm_set1_ps(M_PI / 2), angle), angle);
+  angle = selectPs(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(M_PI), angle), angle);
+  angle = selectPs(_mm_cmplt_ps(y, _mm_setzero_ps()), _mm_sub_ps(_mm_setzero_ps(), angle), angle);
+  __m128 degrees = _mm_mul_ps(angle, _mm_set1_ps(180 / M_PI));
+  return _mm_add_ps(degrees, _mm_and_ps(_mm_cmplt_ps(degrees, _mm_setzero_ps()), _mm_set1_ps(360)));
+}
+#endif
+
+// referenceColorWheelGradient() with the hue table, which gives exactly the same colors. With
+// FAST_WHEEL on the laptop it does four line ends at a time, and hues can land a degree off the
+// reference where the approximate angle crosses a whole degree.
+void colorWheelGradient(Rgb *frame, float centerX, float centerY, float hueOffset)
+{
+  PROFILE_SCOPE("colorWheel");
+  centerX = centerX * 6;
+  centerY = centerY * 6;
+#if defined(LAPTOP_MODE) && defined(__SSE2__) && defined(FAST_WHEEL)
+  // Line ends in frame order
+  alignas(16) float endX[2 * 32];
+  alignas(16) float endY[2 * 32];
+  alignas(16) int hues[2 * 32];
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    endX[2 * i] = lines[i].startX();
+    endY[2 * i] = lines[i].startY();
+    endX[2 * i + 1] = lines[i].endX();
+    endY[2 * i + 1] = lines[i].endY();
+  }
+  const __m128 offset = _mm_set1_ps(hueOffset);
+  const __m128 fullTurn = _mm_set1_ps(360);
+  for (byte i = 0; i < 2 * lineCount(); i += 4)
+  {
+    __m128 dx = _mm_sub_ps(_mm_load_ps(endX + i), _mm_set1_ps(centerX));
+    __m128 dy = _mm_sub_ps(_mm_load_ps(endY + i), _mm_set1_ps(centerY));
+    __m128 hue = _mm_sub_ps(angleDegrees4(dx, dy), offset);
+    hue = _mm_add_ps(hue, _mm_and_ps(_mm_cmplt_ps(hue, _mm_setzero_ps()), fullTurn));
+    hue = _mm_sub_ps(hue, _mm_and_ps(_mm_cmpge_ps(hue, fullTurn), fullTurn));
+    _mm_store_si128((__m128i *)(hues + i), _mm_cvttps_epi32(hue));
+  }
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    if (onWheelCenter(lines[i].startX(), lines[i].startY(), centerX, centerY))
+    {
+      hues[2 * i] = hues[2 * i + 1];
+    }
+    else if (onWheelCenter(lines[i].endX(), lines[i].endY(), centerX, centerY))
+    {
+      hues[2 * i + 1] = hues[2 * i];
+    }
+  }
+  for (byte i = 0; i < 2 * lineCount(); i++)
+  {
+    frame[i] = hueColor(hues[i]);
+  }
+#else
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    float startAngle = getAngle(centerX, centerY, lines[i].startX(), lines[i].startY());
+    float endAngle = getAngle(centerX, centerY, lines[i].endX(), lines[i].endY());
+    if (onWheelCenter(lines[i].startX(), lines[i].startY(), centerX, centerY))
+    {
+      startAngle = endAngle;
+    }
+    else if (onWheelCenter(lines[i].endX(), lines[i].endY(), centerX, centerY))
+    {
+      endAngle = startAngle;
+    }
+    setLineGradient(frame, i,
+                    hueColor(fmod(360 + startAngle - hueOffset, 360)),
+                    hueColor(fmod(360 + endAngle - hueOffset, 360)));
+  }
+#endif
+}
+
+// Palette mode: each line holds one byte indexing a 256-entry palette, and the palette is rotated
+// instead of recomputing every line's hue. Entry i is h2rgb(i / 256.0), built at compile time so it
+// can live in flash on the micro.
+constexpr byte paletteRise(int i) { return (i * 6 % 256) * 255 / 256; }
+constexpr byte paletteFall(int i) { return (256 - i * 6 % 256) * 255 / 256; }
+constexpr byte paletteRed(int i)
+{
+  return i * 6 / 256 == 0 ? 0 : i * 6 / 256 == 1 ? paletteRise(i) : i * 6 / 256 == 4 ? paletteFall(i) : i * 6 / 256 == 5 ? 0 : 255;
+}
+constexpr byte paletteGreen(int i)
+{
+  return i * 6 / 256 == 0 ? paletteFall(i) : i * 6 / 256 <= 2 ? 0 : i * 6 / 256 == 3 ? paletteRise(i) : 255;
+}
+constexpr byte paletteBlue(int i)
+{
+  return i * 6 / 256 <= 1 ? 255 : i * 6 / 256 == 2 ? paletteFall(i) : i * 6 / 256 <= 4 ? 0 : paletteRise(i);
+}
+
+#define PALETTE_ENTRY(i) {paletteRed(i), paletteGreen(i), paletteBlue(i)}
+const byte rainbowPalette[256][3] PROGMEM = {TABLE_256(PALETTE_ENTRY)};
+
+BOARD_LOCAL byte paletteIndex[32];
+// Added to every line's palette index, so advancing it cycles every color at once
+BOARD_LOCAL byte paletteRotation = 0;
+
+Rgb paletteColor(byte index)
+{
+  const byte *entry = rainbowPalette[index];
+  return packRgb(progmemByte(entry), progmemByte(entry + 1), progmemByte(entry + 2));
+}
+
+// Looks up every line's rotated palette entry
+void renderPalette(Rgb *frame)
+{
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    setLineColor(frame, i, paletteColor(paletteIndex[i] + paletteRotation));
+  }
+}
+
+template <class Random = DefaultRandom>
+byte getRandomPaletteIndex()
+{
+  return Random::random(0, 256);
+}
+
+template <class Random = DefaultRandom>
+void randomizePaletteColors()
+{
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    paletteIndex[i] = getRandomPaletteIndex<Random>();
+  }
+}
+
+// Palette version of colorWheel(). Only needs calling when the center moves; spinning the wheel is
+// done by changing paletteRotation.
+void paletteColorWheel(float centerX, float centerY)
+{
+  centerX = centerX * 6;
+  centerY = centerY * 6;
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    float angle = getAngle(centerX, centerY, lines[i].centerX(), lines[i].centerY());
+    paletteIndex[i] = (int)(angle * 256 / 360) & 0xFF;
+  }
+}
+
+// Effects paint opaque line gradients into a frame. t is how far through one revolution of the
+// visualization we are, from 0 to 65535. Deriving from Effect<> supplies empty begin() and end().
+// Effects are dispatched at compile time through EffectList, so there are no virtual calls.
+template <class Derived>
+class Effect
+{
+public:
+  void begin() {}
+  void end() {}
+};
+
+// Where the color wheel is centered, from 0 to 1. Read from the dials on the micro.
+BOARD_LOCAL float rainbowCenterX = 0.5;
+BOARD_LOCAL float rainbowCenterY = 0.5;
+
+class ColorWheelEffect : public Effect<ColorWheelEffect>
+{
+public:
+  void render(Rgb *frame, word t)
+  {
+    colorWheelGradient(frame, rainbowCenterX, rainbowCenterY, t * (360 / 65536.0));
+  }
+};
+
+const byte SWIPE_LEFT = 0;
+const byte SWIPE_UP = 1;
+const byte SWIPE_DOWN = 2;
+const byte SWIPE_RIGHT = 3;
+
+// Sweeps the rainbow across the board in a straight line. Each line end's position along the sweep
+// is worked out once in begin(), so a frame is only an add and a lookup per line end.
+template <byte Direction>
+class OrthogonalSwipeEffect : public Effect<OrthogonalSwipeEffect<Direction>>
+{
+  // Position of each line's start and end along the sweep, from 0 to 255
+  byte _position[2 * 32];
+
+  static byte positionOf(byte x, byte y)
+  {
+    // Line ends are between 0 and 6 on both axes
+    byte along = (Direction == SWIPE_LEFT || Direction == SWIPE_RIGHT ? x : y) * 255 / 6;
+    return (Direction == SWIPE_LEFT || Direction == SWIPE_UP) ? 255 - along : along;
+  }
+
+public:
+  void begin()
+  {
+    for (byte i = 0; i < lineCount(); i++)
+    {
+      _position[2 * i] = positionOf(lines[i].startX(), lines[i].startY());
+      _position[2 * i + 1] = positionOf(lines[i].endX(), lines[i].endY());
+    }
+  }
+
+  void render(Rgb *frame, word t)
+  {
+    byte phase = t >> 8;
+    for (byte i = 0; i < 2 * lineCount(); i++)
+    {
+      frame[i] = paletteColor(_position[i] - phase);
+    }
+  }
+};
+
+class PaletteWheelEffect : public Effect<PaletteWheelEffect>
+{
+  float _centerX = -1;
+  float _centerY = -1;
+
+public:
+  void begin() { _centerX = -1; }
+  void render(Rgb *frame, word t)
+  {
+    if (_centerX != rainbowCenterX || _centerY != rainbowCenterY)
+    {
+      _centerX = rainbowCenterX;
+      _centerY = rainbowCenterY;
+      paletteColorWheel(_centerX, _centerY);
+    }
+    // Same direction of travel as colorWheel(), which subtracts the offset from each hue
+    paletteRotation = -(t >> 8);
+    renderPalette(frame);
+  }
+};
+
+class PaletteRandomEffect : public Effect<PaletteRandomEffect>
+{
+public:
+  void begin() { randomizePaletteColors<>(); }
+  void render(Rgb *frame, word t)
+  {
+    paletteRotation = t >> 8;
+    renderPalette(frame);
+  }
+};
+
+// Precomputed animations, made on the laptop by --compile-animation. An animation is one revolution
+// of an effect, stored as a stream of frames that each only encode how they differ from the one
+// before, so playing it back costs a few integer ops per changed line end instead of the effect's
+// floating point math. Layout, little-endian:
+//   'P' 'A', entries per frame, frame count (2 bytes), loop offset (4 bytes)
+//   the last frame, encoded against black, so playback can start from nothing
+//   every frame in order, encoded against the one before; the first against the last
+// Each encoded frame is a run of ops until all its entries are covered. An op below 0x80 skips
+// op + 1 unchanged entries, and any other op is followed by (op & 0x7F) + 1 new colors, 3 bytes each.
+const byte ANIMATION_HEADER_SIZE = 9;
+
+// Build with -DCOMPILED_ANIMATION to play the animation.h written by --compile-animation
+#ifdef COMPILED_ANIMATION
+#include "animation.h"
+const byte *animationData = compiledAnimation;
+#else
+const byte *animationData = NULL;
+#endif
+
+// Plays animationData. Frames are decoded straight into the frame being rendered, so it relies on
+// nothing else drawing there between renders.
+class AnimationEffect : public Effect<AnimationEffect>
+{
+  const byte *_next = NULL;
+  word _frame = 0;
+
+  static unsigned long readLong(const byte *data)
+  {
+    return progmemByte(data) | (word)progmemByte(data + 1) << 8 | (unsigned long)progmemByte(data + 2) << 16 |
+           (unsigned long)progmemByte(data + 3) << 24;
+  }
+
+  void decodeFrame(Rgb *frame, byte entries)
+  {
+    byte entry = 0;
+    while (entry < entries)
+    {
+      byte op = progmemByte(_next++);
+      byte count = (op & 0x7F) + 1;
+      if (op & 0x80)
+      {
+        for (byte i = 0; i < count; i++, _next += 3)
+        {
+          frame[entry++] = packRgb(progmemByte(_next), progmemByte(_next + 1), progmemByte(_next + 2));
+        }
+      }
+      else
+      {
+        entry += count;
+      }
+    }
+  }
+
+public:
+  void begin() { _next = NULL; }
+
+  void render(Rgb *frame, word t)
+  {
+    if (animationData == NULL)
+    {
+      memset(frame, 0, 2 * lineCount() * sizeof(Rgb));
+      return;
+    }
+    byte entries = progmemByte(animationData + 2);
+    word frameCount = progmemByte(animationData + 3) | (word)progmemByte(animationData + 4) << 8;
+    const byte *loop = animationData + readLong(animationData + 5);
+    if (_next == NULL)
+    {
+      // Start on the last frame, so the first one decoded below is frame 0
+      memset(frame, 0, entries * sizeof(Rgb));
+      _next = animationData + ANIMATION_HEADER_SIZE;
+      decodeFrame(frame, entries);
+      _frame = frameCount - 1;
+    }
+    word target = (unsigned long)t * frameCount >> 16;
+    while (_frame != target)
+    {
+      if (++_frame == frameCount)
+      {
+        _frame = 0;
+        _next = loop;
+      }
+      decodeFrame(frame, entries);
+    }
+  }
+};
+
+#ifdef LAPTOP_MODE
+long long monotonicMicros()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// How far periodic events land from their cadence, for the real-time mode's report. Counts go into
+// fixed buckets, so recording never allocates; the last bucket holds everything past the range.
+class JitterStats
+{
+  static const int BUCKETS = 4096;
+  unsigned long _counts[BUCKETS];
+  long _bucketUs;
+  long _periodUs = 0;
+  long long _lastUs = -1;
+  unsigned long _count = 0;
+  unsigned long _overruns = 0;
+  double _sumUs = 0;
+  long _worstUs = 0;
+
+  long percentileUs(double fraction)
+  {
+    unsigned long target = (unsigned long)(fraction * (_count - 1));
+    unsigned long seen = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+      seen += _counts[i];
+      if (seen > target)
+      {
+        return i * _bucketUs;
+      }
+    }
+    return _worstUs;
+  }
+
+public:
+  explicit JitterStats(long bucketUs) : _bucketUs(bucketUs) { memset(_counts, 0, sizeof(_counts)); }
+
+  bool enabled() { return _periodUs > 0; }
+
+  // Starts counting events that should be periodUs apart
+  void begin(long periodUs)
+  {
+    _periodUs = periodUs;
+    _lastUs = -1;
+  }
+
+  // An event that should have happened at a deadline, lateUs after it
+  void late(long lateUs)
+  {
+    if (!enabled())
+    {
+      return;
+    }
+    lateUs = get_max(lateUs, 0);
+    _counts[std::min(lateUs / _bucketUs, (long)BUCKETS - 1)]++;
+    _count++;
+    _sumUs += lateUs;
+    _worstUs = std::max(_worstUs, lateUs);
+    _overruns += lateUs >= _periodUs;
+  }
+
+  // Forgets the previous event, for when the events stop for a while on purpose
+  void restart()
+  {
+    if (enabled())
+    {
+      _lastUs = -1;
+    }
+  }
+
+  // An event that should come one period after the previous one
+  void interval(long long nowUs)
+  {
+    if (!enabled())
+    {
+      return;
+    }
+    if (_lastUs >= 0)
+    {
+      late(labs((long)(nowUs - _lastUs) - _periodUs));
+    }
+    _lastUs = nowUs;
+  }
+
+  void report(const char *what, FILE *out = stdout)
+  {
+    if (_count == 0)
+    {
+      fprintf(out, "%s: none\n", what);
+      return;
+    }
+    fprintf(out, "%s, %.3f ms apart: %lu, off by %.0f us on average, %ld us at p50, %ld us at p99, %ld us at worst; %lu a whole period or more\n",
+           what, _periodUs / 1000.0, _count, _sumUs / _count, percentileUs(0.5), percentileUs(0.99), _worstUs, _overruns);
+  }
+};
+
+// Audio for SpectrumEffect, from --audio. A WAV file of 16-bit PCM is played at its own pace and
+// starts over when it ends. "-" reads raw 16-bit little-endian mono PCM from stdin at --audio-rate as
+// it arrives, e.g. from arecord -f S16_LE -c 1 -r 44100 -t raw. Samples are mixed down to mono into a
+// fixed ring, so the effect can always look at the newest ones. Reads are at most 5 ms of audio, so a
+// sample is in the ring within 5 ms of being due, well inside a frame.
+const int AUDIO_RING = 8192; // Samples; a power of 2
+const int AUDIO_CHUNK = 512; // The most frames read at once
+const int AUDIO_CHANNELS = 8;
+const int AUDIO_MIN_RATE = 8000;
+const int AUDIO_MAX_RATE = 192000;
+
+class AudioInput
+{
+  int _fd = -1;
+  bool _file = false; // Played at its own pace and looped, rather than read as it arrives
+  int _rate = 44100;
+  int _channels = 1;
+  int _chunkFrames = AUDIO_CHUNK;
+  off_t _dataStart = 0;
+  long long _dataBytes = 0;
+  long long _dataLeft = 0;
+  byte _chunk[AUDIO_CHUNK * AUDIO_CHANNELS * 2];
+  int _partial = 0; // Bytes of a frame the last read cut short, kept at the start of _chunk
+  int16_t _ring[AUDIO_RING] = {};
+  std::atomic<uint32_t> _written{0};
+  std::atomic<long long> _writtenUs{0}; // monotonicMicros() when the newest samples went in
+  std::atomic<bool> _ended{false};
+  std::atomic<bool> _quit{false};
+  std::thread _thread;
+
+  static uint32_t little(const byte *data, int bytes)
+  {
+    uint32_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+      value = value << 8 | data[i];
+    }
+    return value;
+  }
+
+  // Finds the format and the samples, leaving the file at the first sample
+  bool readWavHeader()
+  {
+    byte header[12];
+    if (read(_fd, header, 12) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0)
+    {
+      return false;
+    }
+    bool format = false;
+    byte chunk[8];
+    while (read(_fd, chunk, 8) == 8)
+    {
+      uint32_t size = little(chunk + 4, 4);
+      if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16 && size <= 40)
+      {
+        byte fmt[40];
+        if (read(_fd, fmt, size) != (ssize_t)size)
+        {
+          return false;
+        }
+        // 0xFFFE is the extensible format, which for 16 bits a sample is plain PCM
+        uint32_t tag = little(fmt, 2);
+        _channels = little(fmt + 2, 2);
+        _rate = little(fmt + 4, 4);
+        format = (tag == 1 || tag == 0xFFFE) && little(fmt + 14, 2) == 16 && _channels >= 1 &&
+                 _channels <= AUDIO_CHANNELS && _rate >= AUDIO_MIN_RATE && _rate <= AUDIO_MAX_RATE;
+        if (!format)
+        {
+          return false;
+        }
+      }
+      else if (memcmp(chunk, "data", 4) == 0 && format)
+      {
+        _dataStart = lseek(_fd, 0, SEEK_CUR);
+        // Streamed WAVs can give a size past the end, which is caught when the reads run out
+        _dataBytes = size - size % (2 * _channels);
+        _dataLeft = _dataBytes;
+        return _dataBytes > 0;
+      }
+      else if (lseek(_fd, size + (size & 1), SEEK_CUR) < 0)
+      {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  // Reads up to a chunk and adds the whole frames in it to the ring. False at the end of stdin.
+  bool readChunk()
+  {
+    int frameBytes = 2 * _channels;
+    long long room = _chunkFrames * frameBytes - _partial;
+    if (_file)
+    {
+      if (_dataLeft == 0)
+      {
+        lseek(_fd, _dataStart, SEEK_SET);
+        _dataLeft = _dataBytes;
+      }
+      room = std::min(room, _dataLeft);
+    }
+    ssize_t length = read(_fd, _chunk + _partial, room);
+    if (length < 0 && errno == EINTR)
+    {
+      return true;
+    }
+    if (length <= 0)
+    {
+      // A file shorter than its header says starts over here
+      _dataLeft = 0;
+      return _file && length == 0;
+    }
+    if (_file)
+    {
+      _dataLeft -= length;
+    }
+    int bytes = _partial + length;
+    int frames = bytes / frameBytes;
+    uint32_t at = _written.load(std::memory_order_relaxed);
+    for (int frame = 0; frame < frames; frame++)
+    {
+      const byte *sample = _chunk + frame * frameBytes;
+      int sum = 0;
+      for (int channel = 0; channel < _channels; channel++, sample += 2)
+      {
+        sum += (int16_t)(sample[0] | sample[1] << 8);
+      }
+      _ring[(at + frame) & (AUDIO_RING - 1)] = sum / _channels;
+    }
+    _partial = bytes - frames * frameBytes;
+    memmove(_chunk, _chunk + frames * frameBytes, _partial);
+    _written.store(at + frames, std::memory_order_release);
+    _writtenUs.store(monotonicMicros(), std::memory_order_release);
+    return true;
+  }
+
+  void run()
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    long long frames = 0;
+    while (!_quit.load())
+    {
+      if (_file)
+      {
+        // Each chunk goes in once its last sample is due, so the ring is never ahead of the music
+        std::this_thread::sleep_until(start + std::chrono::microseconds((frames + _chunkFrames) * 1000000 / _rate));
+      }
+      else
+      {
+        // Waits for stdin a little at a time, so closing doesn't hang on a quiet pipe
+        pollfd ready = {_fd, POLLIN, 0};
+        if (poll(&ready, 1, 100) == 0)
+        {
+          continue;
+        }
+      }
+      uint32_t before = _written.load(std::memory_order_relaxed);
+      if (!readChunk())
+      {
+        _ended = true;
+        return;
+      }
+      frames += _written.load(std::memory_order_relaxed) - before;
+    }
+  }
+
+public:
+  ~AudioInput() { close(); }
+
+  bool active() { return _fd >= 0; }
+  int rate() { return _rate; }
+  // How many samples have gone into the ring, wrapping round
+  uint32_t written() { return _written.load(std::memory_order_acquire); }
+  // When the newest samples went into the ring. Taken before written(), the samples then are at least
+  // this new.
+  long long writtenUs() { return _writtenUs.load(std::memory_order_acquire); }
+
+  // rawRate is the sample rate of raw PCM on stdin
+  bool open(const char *path, int rawRate)
+  {
+    if (strcmp(path, "-") == 0)
+    {
+      _fd = STDIN_FILENO;
+      _rate = rawRate;
+      _channels = 1;
+    }
+    else
+    {
+      _fd = ::open(path, O_RDONLY);
+      if (_fd < 0)
+      {
+        perror(path);
+        return false;
+      }
+      if (!readWavHeader())
+      {
+        fprintf(stderr, "%s is not a 16-bit PCM WAV file\n", path);
+        ::close(_fd);
+        _fd = -1;
+        return false;
+      }
+      _file = true;
+    }
+    _chunkFrames = get_max(get_min(_rate / 200, AUDIO_CHUNK), 1);
+    return true;
+  }
+
+  // Reads on a thread of its own from now on
+  void start() { _thread = std::thread(&AudioInput::run, this); }
+
+  // Reads on the calling thread until sample has gone into the ring, for dumps that run on a virtual clock
+  void feedUntil(uint32_t sample)
+  {
+    while (_fd >= 0 && (int32_t)(sample - _written.load()) > 0 && !_ended)
+    {
+      _ended = !readChunk();
+    }
+  }
+
+  // The newest count samples, oldest first, from -1 to 1. Silence before the audio starts and after it ends.
+  void latest(float *samples, int count)
+  {
+    uint32_t end = _written.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++)
+    {
+      samples[i] = _ended ? 0 : _ring[(end - count + i) & (AUDIO_RING - 1)] * (1 / 32768.0f);
+    }
+  }
+
+  void close()
+  {
+    _quit = true;
+    if (_thread.joinable())
+    {
+      _thread.join();
+    }
+    if (_fd > STDIN_FILENO)
+    {
+      ::close(_fd);
+    }
+    _fd = -1;
+  }
+};
+
+AudioInput audioInput;
+
+// From audio going into the ring to the frame drawn with it, counted whenever --audio plays on one
+// board and reported at exit. A whole period or more means a frame drew audio older than a frame.
+JitterStats audioLatency(10);
+
+// Streaming spectrum analysis. The newest SPECTRUM_SIZE samples are Hann windowed and put through a
+// radix-2 FFT, and the energy in each of SPECTRUM_BANDS log-spaced bands becomes a level from 0 to 1.
+// Every buffer and table is a member filled in once, so analyzing a frame allocates nothing.
+const int SPECTRUM_SIZE = 512; // 11.6 ms at 44.1 kHz
+const int SPECTRUM_BITS = 9;
+const int SPECTRUM_BANDS = 16;
+const float SPECTRUM_LOW_HZ = 40;
+const float SPECTRUM_HIGH_HZ = 16000;
+// Levels span this many dB below the loudest band heard lately
+const float SPECTRUM_RANGE_DB = 48;
+// The loudest band is never taken to be quieter than this, so silence stays dark
+const float SPECTRUM_QUIET_DB = 0;
+// How far the loudest band heard falls each analysis, so quiet music comes up over a few seconds
+const float SPECTRUM_PEAK_FALL_DB = 0.05;
+// How much of a band's level is left one analysis after it goes quiet
+const float SPECTRUM_RELEASE = 0.85;
+
+class SpectrumAnalyzer
+{
+  float _window[SPECTRUM_SIZE];
+  float _cos[SPECTRUM_SIZE / 2];
+  float _sin[SPECTRUM_SIZE / 2];
+  uint16_t _reversed[SPECTRUM_SIZE];
+  float _re[SPECTRUM_SIZE];
+  float _im[SPECTRUM_SIZE];
+  // Each band's first bin, and then the bin after the last band
+  int _bandStart[SPECTRUM_BANDS + 1];
+  float _peakDb = SPECTRUM_QUIET_DB;
+
+  void fft()
+  {
+    for (int half = 1; half < SPECTRUM_SIZE; half *= 2)
+    {
+      int step = SPECTRUM_SIZE / (2 * half);
+      for (int start = 0; start < SPECTRUM_SIZE; start += 2 * half)
+      {
+        for (int k = 0; k < half; k++)
+        {
+          int a = start + k;
+          int b = a + half;
+          float wr = _cos[k * step];
+          float wi = _sin[k * step];
+          float tr = _re[b] * wr - _im[b] * wi;
+          float ti = _re[b] * wi + _im[b] * wr;
+          _re[b] = _re[a] - tr;
+          _im[b] = _im[a] - ti;
+          _re[a] += tr;
+          _im[a] += ti;
+        }
+      }
+    }
+  }
+
+public:
+  float levels[SPECTRUM_BANDS] = {};
+
+  SpectrumAnalyzer()
+  {
+    for (int i = 0; i < SPECTRUM_SIZE; i++)
+    {
+      _window[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / SPECTRUM_SIZE);
+      int reversed = 0;
+      for (int bit = 0; bit < SPECTRUM_BITS; bit++)
+      {
+        reversed |= (i >> bit & 1) << (SPECTRUM_BITS - 1 - bit);
+      }
+      _reversed[i] = reversed;
+    }
+    for (int i = 0; i < SPECTRUM_SIZE / 2; i++)
+    {
+      _cos[i] = cosf(2 * M_PI * i / SPECTRUM_SIZE);
+      _sin[i] = -sinf(2 * M_PI * i / SPECTRUM_SIZE);
+    }
+    setRate(44100);
+  }
+
+  void setRate(int rate)
+  {
+    float binHz = rate / (float)SPECTRUM_SIZE;
+    float highHz = std::min(SPECTRUM_HIGH_HZ, rate / 2.0f);
+    _bandStart[0] = get_max((int)(SPECTRUM_LOW_HZ / binHz), 1);
+    for (int band = 1; band <= SPECTRUM_BANDS; band++)
+    {
+      float hz = SPECTRUM_LOW_HZ * powf(highHz / SPECTRUM_LOW_HZ, band / (float)SPECTRUM_BANDS);
+      // Every band gets a bin of its own, even where they're narrower than one
+      _bandStart[band] = get_min(get_max((int)(hz / binHz + 0.5f), _bandStart[band - 1] + 1), SPECTRUM_SIZE / 2);
+    }
+  }
+
+  void analyze(const float *samples)
+  {
+    // Loaded in bit-reversed order, which the FFT works in place from
+    for (int i = 0; i < SPECTRUM_SIZE; i++)
+    {
+      _re[_reversed[i]] = samples[i] * _window[i];
+    }
+    memset(_im, 0, sizeof(_im));
+    fft();
+
+    float bandDb[SPECTRUM_BANDS];
+    float loudest = SPECTRUM_QUIET_DB;
+    for (int band = 0; band < SPECTRUM_BANDS; band++)
+    {
+      float energy = 0;
+      for (int bin = _bandStart[band]; bin < _bandStart[band + 1]; bin++)
+      {
+        energy += _re[bin] * _re[bin] + _im[bin] * _im[bin];
+      }
+      bandDb[band] = 10 * log10f(energy / get_max(_bandStart[band + 1] - _bandStart[band], 1) + 1e-12f);
+      loudest = std::max(loudest, bandDb[band]);
+    }
+    _peakDb = std::max(loudest, _peakDb - SPECTRUM_PEAK_FALL_DB);
+    for (int band = 0; band < SPECTRUM_BANDS; band++)
+    {
+      float level = std::min(std::max((bandDb[band] - _peakDb) / SPECTRUM_RANGE_DB + 1, 0.0f), 1.0f);
+      levels[band] = std::max(level, levels[band] * SPECTRUM_RELEASE);
+    }
+  }
+
+  // The bottom three bands
+  float bass() { return (levels[0] + levels[1] + levels[2]) / 3; }
+
+  float loudness()
+  {
+    float sum = 0;
+    for (float level : levels)
+    {
+      sum += level;
+    }
+    return sum / SPECTRUM_BANDS;
+  }
+};
+
+// How far the bass turns the color wheel, in degrees
+const float SPECTRUM_HUE_SWING = 90;
+// How bright the board is in silence and how bright a line with nothing in its band is, from 0 to 1
+const float SPECTRUM_QUIET_BRIGHTNESS = 0.5;
+const float SPECTRUM_LINE_FLOOR = 0.35;
+
+// The color wheel played along to --audio. Bass turns the wheel further, the music's loudness sets the
+// board's brightness, and each line lights with one band of the spectrum, low on the left to high on
+// the right. Analyzes the newest audio every frame that has some, so what's shown is never more than
+// the analysis window behind. With no audio it is the plain color wheel.
+class SpectrumEffect : public Effect<SpectrumEffect>
+{
+  SpectrumAnalyzer _analyzer;
+  float _samples[SPECTRUM_SIZE];
+  uint32_t _analyzed = 0; // audioInput.written() at the last analysis
+  byte _band[32];
+
+  static Rgb dim(Rgb c, word level)
+  {
+    return packRgb(rgbRed(c) * level >> 8, rgbGreen(c) * level >> 8, rgbBlue(c) * level >> 8);
+  }
+
+public:
+  void begin()
+  {
+    _analyzer.setRate(audioInput.rate());
+    for (byte i = 0; i < lineCount(); i++)
+    {
+      // Line centers are between 0 and 6 across
+      _band[i] = lines[i].centerX() * (SPECTRUM_BANDS - 1) / 6 + 0.5f;
+    }
+  }
+
+  void render(Rgb *frame, word t)
+  {
+    float hueOffset = t * (360 / 65536.0);
+    if (!audioInput.active())
+    {
+      colorWheelGradient(frame, rainbowCenterX, rainbowCenterY, hueOffset);
+      return;
+    }
+    long long capturedUs = audioInput.writtenUs();
+    uint32_t written = audioInput.written();
+    bool heard = written != _analyzed;
+    if (heard)
+    {
+      PROFILE_SCOPE("spectrum");
+      _analyzed = written;
+      audioInput.latest(_samples, SPECTRUM_SIZE);
+      _analyzer.analyze(_samples);
+    }
+    colorWheelGradient(frame, rainbowCenterX, rainbowCenterY, fmodf(hueOffset + _analyzer.bass() * SPECTRUM_HUE_SWING, 360));
+    float brightness = SPECTRUM_QUIET_BRIGHTNESS + (1 - SPECTRUM_QUIET_BRIGHTNESS) * _analyzer.loudness();
+    for (byte i = 0; i < lineCount(); i++)
+    {
+      word level = 256 * brightness * (SPECTRUM_LINE_FLOOR + (1 - SPECTRUM_LINE_FLOOR) * _analyzer.levels[_band[i]]);
+      frame[2 * i] = dim(frame[2 * i], level);
+      frame[2 * i + 1] = dim(frame[2 * i + 1], level);
+    }
+    if (heard)
+    {
+      audioLatency.late(monotonicMicros() - capturedUs);
+    }
+  }
+};
+#endif
+
+template <typename... Effects>
+class EffectList;
+
+template <>
+class EffectList<>
+{
+public:
+  void begin(byte) {}
+  void render(byte, Rgb *, word) {}
+  void end(byte) {}
+};
+
+template <typename First, typename... Rest>
+class EffectList<First, Rest...>
+{
+  First _first;
+  EffectList<Rest...> _rest;
+
+public:
+  void begin(byte index)
+  {
+    if (index == 0)
+      _first.begin();
+    else
+      _rest.begin(index - 1);
+  }
+  void render(byte index, Rgb *frame, word t)
+  {
+    if (index == 0)
+      _first.render(frame, t);
+    else
+      _rest.render(index - 1, frame, t);
+  }
+  void end(byte index)
+  {
+    if (index == 0)
+      _first.end();
+    else
+      _rest.end(index - 1);
+  }
+};
+
+// Where Effect is among the rest, counting from 0
+template <typename Effect, typename First, typename... Rest>
+struct EffectIndex
+{
+  static const byte value = 1 + EffectIndex<Effect, Rest...>::value;
+};
+
+template <typename Effect, typename... Rest>
+struct EffectIndex<Effect, Effect, Rest...>
+{
+  static const byte value = 0;
+};
+
+// The set of effects the rainbow mode can show, one of which is running at a time
+template <typename... Effects>
+class EffectRegistry
+{
+  EffectList<Effects...> _effects;
+  byte _current = 0;
+  bool _begun = false;
+
+public:
+  byte count() { return sizeof...(Effects); }
+  byte current() { return _current; }
+
+  // The index select() takes for Effect
+  template <typename Effect>
+  static constexpr byte indexOf() { return EffectIndex<Effect, Effects...>::value; }
+
+  void select(byte index)
+  {
+    if (_begun)
+    {
+      _effects.end(_current);
+    }
+    _current = index % count();
+    _effects.begin(_current);
+    _begun = true;
+  }
+
+  void render(Rgb *frame, word t)
+  {
+    if (!_begun)
+    {
+      select(_current);
+    }
+    _effects.render(_current, frame, t);
+  }
+};
+
+// AnimationEffect stays last, for --play
+typedef EffectRegistry<ColorWheelEffect,
+                       OrthogonalSwipeEffect<SWIPE_RIGHT>,
+                       OrthogonalSwipeEffect<SWIPE_UP>,
+                       PaletteWheelEffect,
+                       PaletteRandomEffect,
+#ifdef LAPTOP_MODE
+                       SpectrumEffect,
+#endif
+                       AnimationEffect>
+    RainbowEffects;
+
+BOARD_LOCAL RainbowEffects effects;
+
+#ifdef LAPTOP_MODE
+const byte SPECTRUM_EFFECT = RainbowEffects::indexOf<SpectrumEffect>();
+#endif
+
+// Compositor. Each frame is built from layers: the current effect as the background, the snake on
+// top of it, then the cherry and loss flash. Layer colors carry their own alpha. Like every frame,
+// layers hold a gradient per line, so blending works the same on every entry.
+BOARD_LOCAL Rgb backgroundLayer[2 * 32];
+BOARD_LOCAL Rgb snakeLayer[2 * 32];
+BOARD_LOCAL Rgb overlayLayer[2 * 32];
+// What the platform presents. The extra line stays black for LEDs that aren't on a line.
+BOARD_LOCAL Rgb displayFrame[2 * (32 + 1)];
+
+// How bright the effect shows through behind the snake, 0-255
+const byte SNAKE_BACKGROUND_LEVEL = 40;
+
+// Mixes from dst (a = 0) to src (a = 256), keeping dst's alpha
+inline Rgb lerpRgb(Rgb dst, Rgb src, word a)
+{
+#ifdef __AVR__
+  // 8-bit multiplies are native on the AVR, 32-bit ones are not
+  byte r = (rgbRed(src) * a + rgbRed(dst) * (256 - a)) >> 8;
+  byte g = (rgbGreen(src) * a + rgbGreen(dst) * (256 - a)) >> 8;
+  byte b = (rgbBlue(src) * a + rgbBlue(dst) * (256 - a)) >> 8;
+  return packRgb(r, g, b, rgbAlpha(dst));
+#else
+  // Red and blue share one multiply, green gets the other
+  uint32_t rb = (((src & 0xFF00FF) * a + (dst & 0xFF00FF) * (256 - a)) >> 8) & 0xFF00FF;
+  uint32_t g = (((src & 0x00FF00) * a + (dst & 0x00FF00) * (256 - a)) >> 8) & 0x00FF00;
+  return (dst & 0xFF000000) | rb | g;
+#endif
+}
+
+// Blends src over dst with alpha 0-255, keeping dst's alpha
+inline Rgb blendRgb(Rgb dst, Rgb src, byte alpha)
+{
+  // Map 0-255 onto 0-256 so full alpha gives exactly src
+  return lerpRgb(dst, src, alpha + (alpha >> 7));
+}
+
+#if defined(LAPTOP_MODE) && defined(__SSE2__)
+// lerpRgb() on four colors at once. a holds each mix, 0-256, in the low half of its 32-bit lane.
+inline __m128i lerpRgb4(__m128i dst, __m128i src, __m128i a)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16(256);
+  const __m128i alphaMask = _mm_set1_epi32(0xFF000000);
+  // Copy each mix into both 16-bit halves of its lane, then out to the 16-bit lanes of its channels
+  a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+  __m128i aLow = _mm_unpacklo_epi32(a, a);
+  __m128i aHigh = _mm_unpackhi_epi32(a, a);
+  __m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(src, zero), aLow),
+                              _mm_mullo_epi16(_mm_unpacklo_epi8(dst, zero), _mm_sub_epi16(full, aLow)));
+  __m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(src, zero), aHigh),
+                               _mm_mullo_epi16(_mm_unpackhi_epi8(dst, zero), _mm_sub_epi16(full, aHigh)));
+  __m128i mixed = _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8));
+  return _mm_or_si128(_mm_andnot_si128(alphaMask, mixed), _mm_and_si128(alphaMask, dst));
+}
+#endif
+
+// Blends every line of a layer over dst using the layer's own alpha
+void blendLayer(Rgb *dst, const Rgb *layer, byte count)
+{
+  byte i = 0;
+#if defined(LAPTOP_MODE) && defined(__SSE2__)
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i s = _mm_loadu_si128((const __m128i *)(layer + i));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i a = _mm_srli_epi32(s, 24);
+    a = _mm_add_epi32(a, _mm_srli_epi32(a, 7));
+    _mm_storeu_si128((__m128i *)(dst + i), lerpRgb4(d, s, a));
+  }
+#endif
+  for (; i < count; i++)
+  {
+    dst[i] = blendRgb(dst[i], layer[i], rgbAlpha(layer[i]));
+  }
+}
+
+// Where a crossfade starts from, and how far into it we are (255 is finished)
+BOARD_LOCAL Rgb crossfadeFrom[2 * 32];
+BOARD_LOCAL byte crossfadeLevel = 255;
+const byte CROSSFADE_STEP = 32;
+const int CROSSFADE_STEP_MS = 40;
+
+void composeFrame(bool rainbowMode)
+{
+  PROFILE_SCOPE("composeFrame");
+  if (rainbowMode)
+  {
+    memcpy(displayFrame, backgroundLayer, sizeof(backgroundLayer));
+  }
+  else
+  {
+    for (byte i = 0; i < 2 * lineCount(); i++)
+    {
+      displayFrame[i] = blendRgb(packRgb(0, 0, 0), backgroundLayer[i], SNAKE_BACKGROUND_LEVEL);
+    }
+    blendLayer(displayFrame, snakeLayer, 2 * lineCount());
+    blendLayer(displayFrame, overlayLayer, 2 * lineCount());
+  }
+
+  if (crossfadeLevel < 255)
+  {
+    for (byte i = 0; i < 2 * lineCount(); i++)
+    {
+      displayFrame[i] = blendRgb(crossfadeFrom[i], displayFrame[i], crossfadeLevel);
+    }
+  }
+  setLineColor(displayFrame, lineCount(), packRgb(0, 0, 0));
+}
+
+// Output stage. LEDs are linear, so colors are gamma corrected on the way out. The table keeps 8
+// fractional bits, and each channel carries its leftover fraction into the next frame, so dim
+// levels flicker between neighbouring steps and average out to the right brightness.
+const double LED_GAMMA = 2.6;
+#define GAMMA_ENTRY(i) (word)(constexprPow((i) / 255.0, LED_GAMMA) * 255 * 256 + 0.5)
+const word ledGamma[256] PROGMEM = {TABLE_256(GAMMA_ENTRY)};
+
+class OutputStage
+{
+  byte _error[LED_COUNT * 3] = {};
+
+  static inline byte correct(byte level, byte &error)
+  {
+    word corrected = progmemWord(&ledGamma[level]) + error;
+    error = corrected;
+    return corrected >> 8;
+  }
+
+public:
+  // Streams a frame into the strip buffer in one pass over the LEDs in transmit order. ledLine and
+  // ledPosition are the compiled strip layout; each LED samples its line's gradient at its position.
+  void process(const Rgb *colors, const byte *ledLine, const byte *ledPosition, byte *pixels, word ledCount)
+  {
+    byte *error = _error;
+    for (word led = 0; led < ledCount; led++)
+    {
+      const Rgb *gradient = &colors[2 * ledLine[led]];
+      Rgb c = blendRgb(gradient[0], gradient[1], ledPosition[led]);
+      pixels[STRIP_RED] = correct(rgbRed(c), error[0]);
+      pixels[STRIP_GREEN] = correct(rgbGreen(c), error[1]);
+      pixels[STRIP_BLUE] = correct(rgbBlue(c), error[2]);
+      pixels += 3;
+      error += 3;
+    }
+  }
+};
+
+BOARD_LOCAL OutputStage outputStage;
+
+#ifdef LAPTOP_MODE
+// A monitor already applies its own gamma, so the preview maps each LED level back through it to
+// look like the strip rather than like the raw frame
+const double DISPLAY_GAMMA = 2.2;
+#define DISPLAY_ENTRY(i) (byte)(constexprPow((i) / 255.0, 1 / DISPLAY_GAMMA) * 255 + 0.5)
+const byte displayLevel[256] = {TABLE_256(DISPLAY_ENTRY)};
+#endif
+
+#ifdef LAPTOP_MODE
+// Draws anti-aliased thick lines into an in-memory ARGB framebuffer. Which pixels a line covers,
+// how much, and where each pixel falls along the line never change, so they are worked out once in
+// addLine() and drawing is a blend over stored runs of pixels.
+class Rasterizer
+{
+  // A run of covered pixels within one row
+  struct MaskRun
+  {
+    int offset; // Index of the first pixel in the framebuffer
+    int row;
+    int length;
+    int sample; // Index of the first pixel's coverage and position
+  };
+
+  int _width;
+  int _height;
+  std::vector<Rgb> _pixels;
+  std::vector<MaskRun> _runs;
+  std::vector<byte> _coverage; // 0-255
+  std::vector<byte> _position; // 0 at the line's start to 255 at its end
+  std::vector<int> _firstRun;  // Per line, with one extra entry marking the end of the last line
+
+public:
+  Rasterizer(int width, int height) : _width(width), _height(height), _pixels(width * height), _firstRun(1, 0) {}
+
+  int width() { return _width; }
+  int height() { return _height; }
+  Rgb *pixels() { return _pixels.data(); }
+
+  // Forgets every line added, keeping the framebuffer
+  void reset()
+  {
+    _runs.clear();
+    _coverage.clear();
+    _position.clear();
+    _firstRun.assign(1, 0);
+  }
+
+  // Adds a line with round ends and returns the index to draw it with
+  int addLine(float x0, float y0, float x1, float y1, float thickness)
+  {
+    float radius = thickness / 2;
+    float dx = x1 - x0;
+    float dy = y1 - y0;
+    float lengthSquared = dx * dx + dy * dy;
+    int left = get_max(0, floorf(get_min(x0, x1) - radius - 1));
+    int right = get_min(_width - 1, ceilf(get_max(x0, x1) + radius + 1));
+    int top = get_max(0, floorf(get_min(y0, y1) - radius - 1));
+    int bottom = get_min(_height - 1, ceilf(get_max(y0, y1) + radius + 1));
+
+    for (int y = top; y <= bottom; y++)
+    {
+      bool inRun = false;
+      for (int x = left; x <= right; x++)
+      {
+        // Distance from the pixel's center to the nearest point on the line
+        float px = x + 0.5 - x0;
+        float py = y + 0.5 - y0;
+        float t = lengthSquared > 0 ? (px * dx + py * dy) / lengthSquared : 0;
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        float distance = hypotf(px - t * dx, py - t * dy);
+        float coverage = radius + 0.5 - distance;
+        if (coverage <= 0)
+        {
+          inRun = false;
+          continue;
+        }
+        if (!inRun)
+        {
+          _runs.push_back({y * _width + x, y, 0, (int)_coverage.size()});
+          inRun = true;
+        }
+        _runs.back().length++;
+        _coverage.push_back(coverage >= 1 ? 255 : coverage * 255);
+        _position.push_back(t * 255);
+      }
+    }
+    _firstRun.push_back(_runs.size());
+    return _firstRun.size() - 2;
+  }
+
+  void clear(Rgb color)
+  {
+    std::fill(_pixels.begin(), _pixels.end(), color);
+  }
+
+  // Clears a width by height area of another framebuffer, with rows stride pixels apart, whose
+  // top-left pixel is origin
+  void clear(Rgb *origin, int stride, Rgb color)
+  {
+    for (int y = 0; y < _height; y++)
+    {
+      std::fill(origin + y * stride, origin + y * stride + _width, color);
+    }
+  }
+
+  // Draws a line as a gradient from start to end
+  void drawLine(int index, Rgb start, Rgb end)
+  {
+    drawLine(_pixels.data(), _width, index, start, end);
+  }
+
+  // Draws a line into another framebuffer, laid out as for clear()
+  void drawLine(Rgb *origin, int stride, int index, Rgb start, Rgb end)
+  {
+    for (int r = _firstRun[index]; r < _firstRun[index + 1]; r++)
+    {
+      const MaskRun &run = _runs[r];
+      Rgb *pixels = origin + run.offset + run.row * (stride - _width);
+      const byte *coverage = &_coverage[run.sample];
+      const byte *position = &_position[run.sample];
+      int i = 0;
+#ifdef __SSE2__
+      const __m128i zero = _mm_setzero_si128();
+      __m128i starts = _mm_set1_epi32(start);
+      __m128i ends = _mm_set1_epi32(end);
+      for (; i + 4 <= run.length; i += 4)
+      {
+        // Widen four coverage and position bytes to 32-bit lanes, as 0-256 mixes
+        uint32_t packed;
+        memcpy(&packed, coverage + i, 4);
+        __m128i covered = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        covered = _mm_add_epi32(covered, _mm_srli_epi32(covered, 7));
+        memcpy(&packed, position + i, 4);
+        __m128i along = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        along = _mm_add_epi32(along, _mm_srli_epi32(along, 7));
+
+        __m128i colors = lerpRgb4(starts, ends, along);
+        __m128i dst = _mm_loadu_si128((const __m128i *)(pixels + i));
+        _mm_storeu_si128((__m128i *)(pixels + i), lerpRgb4(dst, colors, covered));
+      }
+#endif
+      for (; i < run.length; i++)
+      {
+        pixels[i] = blendRgb(pixels[i], blendRgb(start, end, position[i]), coverage[i]);
+      }
+    }
+  }
+};
+
+const int PREVIEW_WIDTH = 700;
+const int PREVIEW_HEIGHT = 500;
+const int PREVIEW_SCALE = 80;
+const int PREVIEW_THICKNESS = 15;
+
+Rasterizer preview(PREVIEW_WIDTH, PREVIEW_HEIGHT);
+// Rasterizer line index of each LED's share of its line, or -1 when it isn't on one
+int previewLedLine[LED_COUNT];
+
+// Adds every line of a board, and every LED's share of its line, to a preview. Lines are added first,
+// so a line's rasterizer index is its own index. ledShapes gets each LED's rasterizer index.
+void layoutPreview(const BoardTables &board, Rasterizer &raster, int *ledShapes)
+{
+  for (byte i = 0; i < board.lineCount; i++)
+  {
+    Line l = board.lines[i];
+    raster.addLine(l.startX() * PREVIEW_SCALE, l.startY() * PREVIEW_SCALE,
+                   l.endX() * PREVIEW_SCALE, l.endY() * PREVIEW_SCALE, PREVIEW_THICKNESS);
+  }
+  for (word led = 0; led < LED_COUNT; led++)
+  {
+    byte i = board.ledLine[led];
+    if (i == board.lineCount)
+    {
+      ledShapes[led] = -1;
+      continue;
+    }
+    Line l = board.lines[i];
+    float halfSpan = 0.5 / board.lineLedCount[i];
+    float from = board.ledPosition[led] / 256.0 - halfSpan;
+    float to = board.ledPosition[led] / 256.0 + halfSpan;
+    float dx = (l.endX() - l.startX()) * PREVIEW_SCALE;
+    float dy = (l.endY() - l.startY()) * PREVIEW_SCALE;
+    ledShapes[led] = raster.addLine(l.startX() * PREVIEW_SCALE + dx * from, l.startY() * PREVIEW_SCALE + dy * from,
+                                    l.startX() * PREVIEW_SCALE + dx * to, l.startY() * PREVIEW_SCALE + dy * to,
+                                    PREVIEW_THICKNESS);
+  }
+}
+
+void initPreview()
+{
+  BoardTables board;
+  readBoardTables(board);
+  // Every platform's begin() calls this, and the benchmarks set up a game for each run
+  preview.reset();
+  layoutPreview(board, preview, previewLedLine);
+}
+
+// Rasterizes the current frame into a framebuffer with rows stride pixels apart, from its top-left
+// pixel origin
+void renderPreview(Rgb *origin, int stride)
+{
+  preview.clear(origin, stride, packRgb(0, 0, 0));
+
+  if (previewGradients)
+  {
+    // The frame itself at full resolution, as a display with many LEDs per line would show it
+    for (byte i = 0; i < lineCount(); i++)
+    {
+      preview.drawLine(origin, stride, i, displayFrame[2 * i], displayFrame[2 * i + 1]);
+    }
+    return;
+  }
+
+  // Each LED as its share of its line, so the preview shows what the strip is sent
+  for (word led = 0; led < LED_COUNT; led++)
+  {
+    if (previewLedLine[led] < 0)
+    {
+      continue;
+    }
+    byte *c = &stripPixels[led * 3];
+    Rgb color = packRgb(displayLevel[c[STRIP_RED]], displayLevel[c[STRIP_GREEN]], displayLevel[c[STRIP_BLUE]]);
+    preview.drawLine(origin, stride, previewLedLine[led], color, color);
+  }
+}
+
+// Rasterizes the current frame into the preview framebuffer
+void renderPreview()
+{
+  renderPreview(preview.pixels(), preview.width());
+}
+#endif
+
+#ifdef LAPTOP_MODE
+// Bits in SnakeObservation::flags
+const byte SNAKE_ATE = 1;  // The head landed on the cherry this step
+const byte SNAKE_DIED = 2; // The head ran into the body this step
+const byte SNAKE_DONE = 4; // The game is over and ignores actions until it is reset
+
+// What a policy sees of one game after a reset or step
+struct SnakeObservation
+{
+  uint32_t occupancy; // Bit i is set when lines[i] is part of the body
+  byte head;          // Index of the head line
+  byte facing;        // Bit 0 is facingRight, bit 1 is facingUp
+  byte cherry;        // Index of the cherry line, or NO_CHERRY when the board is full
+  byte flags;         // SNAKE_ATE, SNAKE_DIED and SNAKE_DONE
+};
+
+// Steps many independent Snake games in lockstep for offline policy training. State is kept as one
+// array per field so the step loop is a straight pass of table lookups and selects over all games.
+// Moves follow Snake::move(): the tail is dropped before the collision check, and a game that dies
+// stays frozen until it is reset.
+class SnakeBatch
+{
+  static const byte MAX_LINES = 32;
+  static const byte NO_CHERRY = 0xFF;
+
+  int _size;
+
+  // Topology, indexed by (line * 4 + facing) * 3 + action
+  byte _next[MAX_LINES * 4 * 3]; // Packed as in snakeNext
+
+  // Per-game state
+  std::vector<uint32_t> _occupancy;
+  std::vector<uint32_t> _rng;
+  std::vector<byte> _head;
+  std::vector<byte> _facing;
+  std::vector<byte> _length;     // How long the snake is allowed to be
+  std::vector<byte> _bodyLength; // How many lines the body covers right now
+  std::vector<byte> _tail;       // Start of the body ring
+  std::vector<byte> _cherry;
+  std::vector<byte> _done;
+  std::vector<byte> _body; // MAX_LINES ring entries per game, tail first
+
+  byte randomLine(int game)
+  {
+    // xorshift32, one stream per game so results don't depend on the batch size
+    uint32_t x = _rng[game];
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    _rng[game] = x;
+    return x % lineCount();
+  }
+
+  void placeCherry(int game)
+  {
+    uint32_t full = lineCount() == 32 ? 0xFFFFFFFF : (1u << lineCount()) - 1;
+    if ((_occupancy[game] & full) == full)
+    {
+      _cherry[game] = NO_CHERRY;
+      return;
+    }
+    byte cherry = randomLine(game);
+    while (_occupancy[game] & (1u << cherry))
+    {
+      cherry = randomLine(game);
+    }
+    _cherry[game] = cherry;
+  }
+
+  void observe(int game, byte flags, SnakeObservation &observation)
+  {
+    observation.occupancy = _occupancy[game];
+    observation.head = _head[game];
+    observation.facing = _facing[game];
+    observation.cherry = _cherry[game];
+    observation.flags = flags | (_done[game] ? SNAKE_DONE : 0);
+  }
+
+public:
+  // Expects initLines() to have been called
+  SnakeBatch(int size, uint32_t seed) : _size(size),
+                                        _occupancy(size), _rng(size), _head(size), _facing(size),
+                                        _length(size), _bodyLength(size), _tail(size), _cherry(size),
+                                        _done(size), _body(size * MAX_LINES)
+  {
+    // The same move tables Snake uses, so stepping is a lookup instead of pointer chasing
+    memcpy(_next, snakeNext, sizeof(_next));
+    for (int game = 0; game < size; game++)
+    {
+      _rng[game] = seed + game * 0x9E3779B9u;
+      if (_rng[game] == 0)
+      {
+        _rng[game] = 1;
+      }
+    }
+    reset(NULL, NULL);
+  }
+
+  int size() { return _size; }
+
+  // Replaces the cherry the game placed itself, so --equivalence can give it the same cherry as a
+  // Snake. line must not be part of the body.
+  void setCherry(int game, byte line) { _cherry[game] = line; }
+
+  // Restarts every game whose mask entry is non-zero (every game when mask is NULL). Writes the
+  // starting observation of the restarted games when observations is not NULL.
+  void reset(const byte *mask, SnakeObservation *observations)
+  {
+    for (int game = 0; game < _size; game++)
+    {
+      if (mask != NULL && !mask[game])
+      {
+        continue;
+      }
+      _head[game] = 0;
+      _facing[game] = 3;
+      _length[game] = 1;
+      _bodyLength[game] = 1;
+      _tail[game] = 0;
+      _body[game * MAX_LINES] = 0;
+      _occupancy[game] = 1;
+      _done[game] = 0;
+      placeCherry(game);
+      if (observations != NULL)
+      {
+        observe(game, 0, observations[game]);
+      }
+    }
+  }
+
+  // Moves every game one tick. actions[game] is LEFT, STRAIGHT or RIGHT. Writes one observation per
+  // game into the caller's buffer; nothing is allocated.
+  void step(const byte *__restrict actions, SnakeObservation *__restrict observations)
+  {
+    const byte *__restrict nextMove = _next;
+    uint32_t *__restrict occupancy = _occupancy.data();
+    byte *__restrict head = _head.data();
+    byte *__restrict facing = _facing.data();
+    byte *__restrict length = _length.data();
+    byte *__restrict bodyLength = _bodyLength.data();
+    byte *__restrict tail = _tail.data();
+    byte *__restrict cherry = _cherry.data();
+    byte *__restrict done = _done.data();
+    byte *__restrict body = _body.data();
+
+    // Branch-free pass over every game. Finished games compute a move and then discard it.
+    for (int game = 0; game < _size; game++)
+    {
+      uint32_t live = done[game] ? 0 : 0xFFFFFFFF;
+      int index = (head[game] * 4 + facing[game]) * 3 + actions[game];
+      byte next = nextMove[index];
+      byte newHead = next >> 2;
+      byte *ring = body + game * MAX_LINES;
+
+      uint32_t popping = bodyLength[game] >= length[game] ? 0xFFFFFFFF : 0;
+      uint32_t occupied = occupancy[game] & ~((1u << ring[tail[game]]) & popping);
+      uint32_t died = ((occupied >> newHead) & 1) ? live : 0;
+      uint32_t moved = live & ~died;
+      uint32_t ate = newHead == cherry[game] ? moved : 0;
+
+      // The ring write always happens; it lands outside the body when the move is discarded
+      byte newTail = (tail[game] + (popping & 1)) & (MAX_LINES - 1);
+      byte newBodyLength = bodyLength[game] - (popping & 1);
+      ring[(newTail + newBodyLength) & (MAX_LINES - 1)] = (moved & newHead) | (~moved & ring[(newTail + newBodyLength) & (MAX_LINES - 1)]);
+
+      occupancy[game] = (moved & (occupied | (1u << newHead))) | (~moved & occupancy[game]);
+      tail[game] = (moved & newTail) | (~moved & tail[game]);
+      bodyLength[game] = (moved & (newBodyLength + 1)) | (~moved & bodyLength[game]);
+      head[game] = (moved & newHead) | (~moved & head[game]);
+      facing[game] = (moved & (next & 3)) | (~moved & facing[game]);
+      length[game] += ate & 1;
+      done[game] |= died & 1;
+
+      observations[game].flags = (ate & SNAKE_ATE) | (died & SNAKE_DIED);
+    }
+
+    // Eating is rare, so respawning the cherry is left to a second, scalar pass
+    for (int game = 0; game < _size; game++)
+    {
+      if (observations[game].flags & SNAKE_ATE)
+      {
+        placeCherry(game);
+      }
+      observe(game, observations[game].flags, observations[game]);
+    }
+  }
+};
+#endif
+
+// Platforms. Everything the game needs from the hardware goes through a platform's policies, which
+// are picked at compile time, so the game is written once as Game<Platform> and every call inlines.
+//   Clock:  millis()
+//   Input:  begin(), rainbowSwitch(), direction() the snake should turn, revolutionMs() for one
+//           revolution of the visualization, readCenter(x, y) of the color wheel, from 0 to 1
+//   Output: begin(), present() once the frame is in displayFrame and stripBuffer()
+//   Random: begin(), random(low, high), defined with the random pickers further up
+template <class ClockPolicy, class InputPolicy, class OutputPolicy, class RandomPolicy>
+struct Platform
+{
+  typedef ClockPolicy Clock;
+  typedef InputPolicy Input;
+  typedef OutputPolicy Output;
+  typedef RandomPolicy Random;
+};
+
+#ifdef LAPTOP_MODE
+// Snake ticks against SNAKE_STEP_MS, counted while real-time mode runs. Every board ticks it, but only
+// real-time mode, which runs a single board, enables it; until then it is only read.
+JitterStats tickJitter(10);
+
+// Counts allocations through new, so real-time mode can report any made after startup. Threads that
+// allocate by design, like the config watcher's, leave themselves out.
+std::atomic<unsigned long> heapAllocations(0);
+thread_local bool countsAllocations = true;
+
+// Every composed frame published into a POSIX shared-memory ring with --publish NAME, so other
+// processes (a strip driver, a recorder, a viewer) can map it read-only and read frames in place. The
+// game never waits for them: slots are overwritten in turn, and each carries a sequence number that
+// is odd while it is being written. A reader notes the sequence, reads the slot, and keeps what it
+// read only if the sequence is still the same even number.
+const uint32_t SHARED_FRAMES_MAGIC = 0x52464C50; // "PLFR"
+const uint16_t SHARED_FRAMES_VERSION = 1;
+const uint32_t SHARED_FRAME_SLOTS = 8;
+
+struct SharedFrameSlot
+{
+  std::atomic<uint32_t> sequence;
+  uint32_t entries;          // How many of lines are used, 2 per line
+  uint64_t frame;            // Counts up from 1
+  uint64_t timeUs;           // monotonicMicros() when published
+  Rgb lines[2 * 32];         // Line gradients, as in displayFrame
+  byte strip[LED_COUNT * 3]; // The strip's bytes, in transmit order
+};
+
+struct SharedFrames
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t slotBytes; // sizeof(SharedFrameSlot), for readers built against another layout
+  uint32_t slots;
+  uint16_t leds;
+  byte stripRed; // Byte offsets of each color within an LED's 3 strip bytes
+  byte stripGreen;
+  byte stripBlue;
+  byte reserved[3];
+  std::atomic<uint64_t> latest; // Frame number of the newest complete slot, 0 before the first
+  SharedFrameSlot slot[SHARED_FRAME_SLOTS];
+};
+
+class FramePublisher
+{
+  SharedFrames *_shared = NULL;
+  std::string _name;
+  uint64_t _frame = 0;
+
+public:
+  ~FramePublisher() { close(); }
+
+  bool open(const char *name)
+  {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(SharedFrames)) != 0)
+    {
+      perror(name);
+      if (fd >= 0)
+      {
+        ::close(fd);
+      }
+      return false;
+    }
+    void *memory = mmap(NULL, sizeof(SharedFrames), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+      perror(name);
+      return false;
+    }
+    // ftruncate() zeroed it, so every sequence starts even and latest at 0
+    _shared = (SharedFrames *)memory;
+    _shared->slotBytes = sizeof(SharedFrameSlot);
+    _shared->slots = SHARED_FRAME_SLOTS;
+    _shared->leds = LED_COUNT;
+    _shared->stripRed = STRIP_RED;
+    _shared->stripGreen = STRIP_GREEN;
+    _shared->stripBlue = STRIP_BLUE;
+    _shared->version = SHARED_FRAMES_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    _shared->magic = SHARED_FRAMES_MAGIC;
+    _name = name;
+    return true;
+  }
+
+  void close()
+  {
+    if (_shared != NULL)
+    {
+      munmap(_shared, sizeof(SharedFrames));
+      shm_unlink(_name.c_str());
+      _shared = NULL;
+    }
+  }
+
+  void publish(const Rgb *lines, byte entries, const byte *strip)
+  {
+    if (_shared == NULL)
+    {
+      return;
+    }
+    _frame++;
+    SharedFrameSlot &slot = _shared->slot[_frame % SHARED_FRAME_SLOTS];
+    uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.entries = entries;
+    slot.frame = _frame;
+    slot.timeUs = monotonicMicros();
+    memcpy(slot.lines, lines, entries * sizeof(Rgb));
+    memcpy(slot.strip, strip, sizeof(slot.strip));
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    _shared->latest.store(_frame, std::memory_order_release);
+  }
+};
+
+FramePublisher framePublisher;
+
+// The rainbow's phase shared between processes, so boards run by separate plac-mans spin in step.
+// --lead-clock NAME publishes where the wheel was at a moment on the monotonic clock, which every
+// process on the machine reads the same, and how long a turn takes. --follow-clock NAME works out the
+// phase from that on its own every frame, so following is a few loads and never waits on the leader.
+// The anchor only moves when the speed does, under an odd/even sequence like the frame ring's.
+// Followers also note how far their frames land from the leader's, for --watch-clock.
+const uint32_t SHARED_CLOCK_MAGIC = 0x4B4C4C50; // "PLLK"
+const uint16_t SHARED_CLOCK_VERSION = 2;
+const uint16_t SHARED_CLOCK_FOLLOWERS = 16;
+// How many times a follower reads the anchor while it is being moved before using the last one it
+// got. Moving it is a few stores, so running out means the leader died or was preempted mid-move.
+const int SHARED_CLOCK_READ_TRIES = 1000;
+
+struct SharedClockAnchor
+{
+  int64_t us;        // monotonicMicros() at the anchor
+  uint32_t phase;    // Where the wheel was then, in 1/2^32 of a turn
+  uint32_t periodUs; // How long one turn takes
+};
+
+// The wheel's phase at us, the same in every process reading the same anchor
+uint32_t clockPhaseAt(const SharedClockAnchor &anchor, long long us)
+{
+  long long within = (us - anchor.us) % anchor.periodUs;
+  if (within < 0)
+  {
+    within += anchor.periodUs;
+  }
+  return anchor.phase + (uint32_t)(((uint64_t)within << 32) / anchor.periodUs);
+}
+
+// Written only by the follower holding it
+struct SharedClockFollower
+{
+  std::atomic<int32_t> pid; // 0 while the slot is free
+  uint32_t reserved;
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> lagSumUs; // How long before each frame the leader last drew its own
+  std::atomic<uint64_t> worstLagUs;
+  std::atomic<uint64_t> apartSum; // How far apart the phases the two frames drew are, in 1/2^32 of a turn
+  std::atomic<uint64_t> worstApart;
+};
+
+struct SharedClock
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t followers;
+  std::atomic<uint32_t> sequence; // Odd while the anchor is being moved
+  uint32_t reserved;
+  SharedClockAnchor anchor;
+  // The leader's last rainbow frame: the phase it drew in the high half and the low half of
+  // monotonicMicros() when it drew it, in one word so they are read together. 0 before it has drawn.
+  std::atomic<uint64_t> shown;
+  SharedClockFollower follower[SHARED_CLOCK_FOLLOWERS];
+};
+
+class SharedClockLink
+{
+  SharedClock *_shared = NULL;
+  std::string _name;
+  bool _leading = false;
+  SharedClockFollower *_follower = NULL;
+  SharedClockAnchor _anchor = {}; // The last anchor read whole
+
+  SharedClockAnchor readAnchor()
+  {
+    for (int tries = 0; tries < SHARED_CLOCK_READ_TRIES; tries++)
+    {
+      uint32_t before = _shared->sequence.load(std::memory_order_acquire);
+      SharedClockAnchor anchor = _shared->anchor;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (!(before & 1) && _shared->sequence.load(std::memory_order_relaxed) == before)
+      {
+        _anchor = anchor;
+        break;
+      }
+    }
+    return _anchor;
+  }
+
+public:
+  ~SharedClockLink() { close(); }
+
+  bool active() { return _shared != NULL; }
+
+  bool lead(const char *name)
+  {
+    close();
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(SharedClock)) != 0)
+    {
+      perror(name);
+      if (fd >= 0)
+      {
+        ::close(fd);
+      }
+      return false;
+    }
+    void *memory = mmap(NULL, sizeof(SharedClock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+      perror(name);
+      return false;
+    }
+    // ftruncate() zeroed it, so the sequence starts even and every follower slot free
+    _shared = (SharedClock *)memory;
+    _shared->anchor.us = monotonicMicros();
+    _shared->anchor.phase = 0;
+    _shared->anchor.periodUs = 5000 * 1000;
+    _shared->followers = SHARED_CLOCK_FOLLOWERS;
+    _shared->version = SHARED_CLOCK_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    _shared->magic = SHARED_CLOCK_MAGIC;
+    _name = name;
+    _leading = true;
+    return true;
+  }
+
+  bool follow(const char *name)
+  {
+    close();
+    int fd = shm_open(name, O_RDWR, 0);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+      perror(name);
+      if (fd >= 0)
+      {
+        ::close(fd);
+      }
+      return false;
+    }
+    void *memory = info.st_size < (off_t)sizeof(SharedClock) ? MAP_FAILED : mmap(NULL, sizeof(SharedClock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    SharedClock *shared = (SharedClock *)memory;
+    if (memory == MAP_FAILED || shared->magic != SHARED_CLOCK_MAGIC || shared->version != SHARED_CLOCK_VERSION ||
+        shared->followers != SHARED_CLOCK_FOLLOWERS)
+    {
+      fprintf(stderr, "%s: not a clock this build can follow\n", name);
+      if (memory != MAP_FAILED)
+      {
+        munmap(memory, sizeof(SharedClock));
+      }
+      return false;
+    }
+    _shared = shared;
+    // Something to fall back on should the first read find the anchor mid-move
+    _anchor = _shared->anchor;
+    if (_anchor.periodUs == 0)
+    {
+      _anchor.periodUs = 5000 * 1000;
+    }
+    readAnchor();
+    // Take a free slot, or one whose follower exited without giving it back
+    for (int i = 0; i < SHARED_CLOCK_FOLLOWERS && _follower == NULL; i++)
+    {
+      SharedClockFollower &slot = _shared->follower[i];
+      int32_t pid = slot.pid.load(std::memory_order_relaxed);
+      if ((pid == 0 || (kill(pid, 0) != 0 && errno == ESRCH)) && slot.pid.compare_exchange_strong(pid, getpid()))
+      {
+        slot.frames = 0;
+        slot.lagSumUs = 0;
+        slot.worstLagUs = 0;
+        slot.apartSum = 0;
+        slot.worstApart = 0;
+        _follower = &slot;
+      }
+    }
+    if (_follower == NULL)
+    {
+      fprintf(stderr, "%s: already has %d followers; following without reporting\n", name, SHARED_CLOCK_FOLLOWERS);
+    }
+    _leading = false;
+    return true;
+  }
+
+  void close()
+  {
+    if (_shared == NULL)
+    {
+      return;
+    }
+    if (_follower != NULL)
+    {
+      _follower->pid.store(0, std::memory_order_release);
+      _follower = NULL;
+    }
+    munmap(_shared, sizeof(SharedClock));
+    if (_leading)
+    {
+      shm_unlink(_name.c_str());
+    }
+    _shared = NULL;
+  }
+
+  // How far through its turn the wheel is now, 0-1. The leader turns at periodMs; followers at
+  // whatever the leader does.
+  float phase(int periodMs)
+  {
+    long long nowUs = monotonicMicros();
+    if (_leading)
+    {
+      SharedClockAnchor anchor = _shared->anchor;
+      if (anchor.periodUs != (uint32_t)periodMs * 1000)
+      {
+        // Change speed from where the wheel is now, so it doesn't jump
+        anchor.phase = clockPhaseAt(anchor, nowUs);
+        anchor.us = nowUs;
+        anchor.periodUs = periodMs * 1000;
+        uint32_t sequence = _shared->sequence.load(std::memory_order_relaxed);
+        _shared->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        _shared->anchor = anchor;
+        _shared->sequence.store(sequence + 2, std::memory_order_release);
+      }
+      uint32_t phase = clockPhaseAt(anchor, nowUs);
+      _shared->shown.store((uint64_t)phase << 32 | ((uint32_t)nowUs | 1), std::memory_order_release);
+      return phase / 4294967296.0;
+    }
+
+    SharedClockAnchor anchor = readAnchor();
+    uint32_t phase = clockPhaseAt(anchor, nowUs);
+    uint64_t shown = _shared->shown.load(std::memory_order_acquire);
+    if (_follower != NULL && shown != 0)
+    {
+      // Against the phase the leader drew, not one worked out here, so a stale anchor on either side shows
+      int32_t lag = (int32_t)((uint32_t)nowUs - (uint32_t)shown);
+      uint64_t lagUs = lag < 0 ? -(int64_t)lag : lag;
+      int32_t apart = (int32_t)(phase - (uint32_t)(shown >> 32));
+      uint64_t apartTurns = apart < 0 ? -(int64_t)apart : apart;
+      _follower->frames.fetch_add(1, std::memory_order_relaxed);
+      _follower->lagSumUs.fetch_add(lagUs, std::memory_order_relaxed);
+      _follower->apartSum.fetch_add(apartTurns, std::memory_order_relaxed);
+      if (lagUs > _follower->worstLagUs.load(std::memory_order_relaxed))
+      {
+        _follower->worstLagUs.store(lagUs, std::memory_order_relaxed);
+      }
+      if (apartTurns > _follower->worstApart.load(std::memory_order_relaxed))
+      {
+        _follower->worstApart.store(apartTurns, std::memory_order_relaxed);
+      }
+    }
+    return phase / 4294967296.0;
+  }
+};
+
+SharedClockLink sharedClock;
+
+// Settings from --config FILE, which is read again whenever it is saved, so they can be tuned while the
+// game runs. One setting a line, and # starts a comment:
+//   revolution-ms MS     how long the rainbow takes to turn once
+//   center X Y           where the color wheel is centered, from 0 to 1
+//   hue-shift DEGREES    turns every rainbow color this far
+//   effect N             the effect the rainbow shows; left to the E key when not given
+//   layout FILE          a layout from --compile-layout to play on; the built-in board when not given
+struct LiveSettings
+{
+  int revolutionMs = 5000;
+  float centerX = 0.5;
+  float centerY = 0.5;
+  int hueShift = 0;
+  int effect = -1;
+};
+
+LiveSettings liveSettings;
+
+// What the config watcher builds for the game to swap in between frames: the settings, the board's
+// tables and its preview, rasterized
+struct Reload
+{
+  LiveSettings settings;
+  BoardTables board;
+  Rasterizer preview = Rasterizer(PREVIEW_WIDTH, PREVIEW_HEIGHT);
+  int previewLedLine[LED_COUNT];
+};
+
+// Watches the config file and the layout it names with inotify. Whenever either is saved, a thread of
+// its own reads them and builds a Reload, and publishes it by swapping a pointer. The game takes it
+// at the start of a frame, and hands the one it replaced back to be freed here, so the game never
+// parses, maps, allocates or frees anything for a reload. A config or layout with a mistake in it is
+// reported and the game carries on with what it has.
+class ConfigWatcher
+{
+  std::string _configPath;
+  std::string _layoutPath; // From --layout, for when the config names none
+  BoardTables _builtIn;
+  std::atomic<Reload *> _pending{NULL};
+  std::atomic<Reload *> _retired{NULL};
+  std::atomic<bool> _quit{false};
+  std::thread _thread;
+
+  bool readSettings(LiveSettings &settings, std::string &layoutPath)
+  {
+    FILE *file = fopen(_configPath.c_str(), "r");
+    if (file == NULL)
+    {
+      perror(_configPath.c_str());
+      return false;
+    }
+    char text[256];
+    int number = 0;
+    bool ok = true;
+    while (ok && fgets(text, sizeof(text), file))
+    {
+      number++;
+      char *comment = strchr(text, '#');
+      if (comment != NULL)
+      {
+        *comment = '\0';
+      }
+      char keyword[16] = "";
+      char path[200];
+      if (sscanf(text, "%15s", keyword) < 1)
+      {
+        continue;
+      }
+      bool understood = false;
+      if (strcmp(keyword, "revolution-ms") == 0)
+      {
+        understood = sscanf(text, "%*s %d", &settings.revolutionMs) == 1 && settings.revolutionMs > 0;
+      }
+      else if (strcmp(keyword, "center") == 0)
+      {
+        understood = sscanf(text, "%*s %f %f", &settings.centerX, &settings.centerY) == 2;
+      }
+      else if (strcmp(keyword, "hue-shift") == 0)
+      {
+        understood = sscanf(text, "%*s %d", &settings.hueShift) == 1;
+      }
+      else if (strcmp(keyword, "effect") == 0)
+      {
+        understood = sscanf(text, "%*s %d", &settings.effect) == 1 && settings.effect >= 0;
+      }
+      else if (strcmp(keyword, "layout") == 0 && sscanf(text, "%*s %199s", path) == 1)
+      {
+        layoutPath = path;
+        understood = true;
+      }
+      if (!understood)
+      {
+        fprintf(stderr, "%s:%d: can't read \"%s\"\n", _configPath.c_str(), number, strtok(text, "\r\n"));
+        ok = false;
+      }
+    }
+    fclose(file);
+    return ok;
+  }
+
+  // Reads the config and the layout it names and lays the board out, or says why it can't
+  Reload *build(std::string &layoutPath)
+  {
+    std::unique_ptr<Reload> reload(new Reload());
+    layoutPath = _layoutPath;
+    if (!readSettings(reload->settings, layoutPath))
+    {
+      return NULL;
+    }
+    MappedLayout mapped;
+    if (layoutPath.empty())
+    {
+      reload->board = _builtIn;
+    }
+    else if (mapped.open(layoutPath.c_str()))
+    {
+      // The tables are copies, so the layout can be unmapped once they're made
+      layoutBoardTables(mapped.view(), reload->board);
+    }
+    else
+    {
+      return NULL;
+    }
+    layoutPreview(reload->board, reload->preview, reload->previewLedLine);
+    return reload.release();
+  }
+
+  void publish(Reload *reload)
+  {
+    delete _retired.exchange(NULL);
+    // One the game hasn't taken yet is simply replaced
+    delete _pending.exchange(reload);
+  }
+
+#ifdef __linux__
+  // Watches the directories, since editors often save by writing a new file and renaming it over the old
+  static int watchDirectory(int fd, const std::string &path)
+  {
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    return inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+  }
+
+  static bool isFile(const inotify_event *event, int wd, const std::string &path)
+  {
+    size_t slash = path.rfind('/');
+    return event->wd == wd && event->len > 0 && strcmp(event->name, path.c_str() + (slash == std::string::npos ? 0 : slash + 1)) == 0;
+  }
+
+  void watch(std::string layoutPath)
+  {
+    countsAllocations = false;
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0)
+    {
+      perror("inotify");
+      return;
+    }
+    int configWd = watchDirectory(fd, _configPath);
+    int layoutWd = layoutPath.empty() ? -1 : watchDirectory(fd, layoutPath);
+    alignas(inotify_event) char buffer[4096];
+    while (!_quit.load())
+    {
+      pollfd ready = {fd, POLLIN, 0};
+      if (poll(&ready, 1, 200) <= 0)
+      {
+        continue;
+      }
+      bool changed = false;
+      // Gather the burst of events one save makes before reading anything
+      do
+      {
+        ssize_t length;
+        while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+        {
+          for (char *at = buffer; at < buffer + length; at += sizeof(inotify_event) + ((inotify_event *)at)->len)
+          {
+            const inotify_event *event = (const inotify_event *)at;
+            changed |= isFile(event, configWd, _configPath) || (layoutWd >= 0 && isFile(event, layoutWd, layoutPath));
+          }
+        }
+      } while (poll(&ready, 1, 50) > 0);
+      if (!changed)
+      {
+        continue;
+      }
+      long long startUs = monotonicMicros();
+      Reload *reload = build(layoutPath);
+      if (reload != NULL)
+      {
+        publish(reload);
+        fprintf(stderr, "Reloaded %s in %lld us\n", _configPath.c_str(), monotonicMicros() - startUs);
+        layoutWd = layoutPath.empty() ? -1 : watchDirectory(fd, layoutPath);
+      }
+    }
+    close(fd);
+  }
+#endif
+
+public:
+  ~ConfigWatcher() { stop(); }
+
+  // Reads the config once now, so mistakes in it stop the game from starting, then watches it.
+  // Expects the built-in board not to be running yet.
+  bool start(const char *configPath, const char *layoutPath)
+  {
+    _configPath = configPath;
+    _layoutPath = layoutPath ? layoutPath : "";
+    initLines();
+    compileStripLayout(stripLayout, sizeof(stripLayout) / sizeof(StripRun));
+    readBoardTables(_builtIn);
+    std::string watchedLayout;
+    Reload *reload = build(watchedLayout);
+    if (reload == NULL)
+    {
+      return false;
+    }
+    publish(reload);
+#ifdef __linux__
+    _thread = std::thread(&ConfigWatcher::watch, this, watchedLayout);
+#else
+    fprintf(stderr, "Watching %s needs inotify; it is read once\n", configPath);
+#endif
+    return true;
+  }
+
+  void stop()
+  {
+    _quit = true;
+    if (_thread.joinable())
+    {
+      _thread.join();
+    }
+    delete _pending.exchange(NULL);
+    delete _retired.exchange(NULL);
+  }
+
+  // The newest Reload, if there is one the game hasn't taken
+  Reload *take() { return _pending.exchange(NULL); }
+
+  // Hands back a Reload the game has swapped in, holding what it replaced
+  void retire(Reload *reload) { delete _retired.exchange(reload); }
+};
+
+ConfigWatcher configWatcher;
+
+struct SystemClock
+{
+  static unsigned long millis()
+  {
+    timeb tb;
+    ftime(&tb);
+    return tb.millitm + (tb.time & 0xfffff) * 1000;
+  }
+};
+
+// Only moves when told to, so a run can be replayed frame for frame
+struct VirtualClock
+{
+  static unsigned long nowMs;
+  static unsigned long millis() { return nowMs; }
+};
+unsigned long VirtualClock::nowMs = 0;
+
+// The keys handled in main()
+struct KeyboardInput
+{
+  static void begin() {}
+  static bool rainbowSwitch() { return rainbow; }
+  static byte direction() { return ::direction; }
+  static int revolutionMs() { return liveSettings.revolutionMs; }
+  static void readCenter(float &x, float &y)
+  {
+    x = liveSettings.centerX;
+    y = liveSettings.centerY;
+  }
+};
+
+// Uploads a rasterized preview to the window and shows it
+void showPreview(const Rgb *pixels)
+{
+  SDL_UpdateTexture(previewTexture, NULL, pixels, PREVIEW_WIDTH * sizeof(Rgb));
+  SDL_RenderCopy(renderer, previewTexture, NULL, NULL);
+  // Waits for vsync when the renderer has it on
+  PROFILE_SCOPE("SDL_RenderPresent");
+  SDL_RenderPresent(renderer);
+}
+
+struct WindowOutput
+{
+  static void begin() { initPreview(); }
+  static void present()
+  {
+    PROFILE_SCOPE("draw");
+    renderPreview();
+    showPreview(preview.pixels());
+  }
+};
+
+// Renders the preview without a window, for frame dumps
+struct PreviewOutput
+{
+  static void begin() { initPreview(); }
+  static void present()
+  {
+    PROFILE_SCOPE("draw");
+    renderPreview();
+  }
+};
+
+typedef Platform<SystemClock, KeyboardInput, WindowOutput, LibcRandom> LaptopPlatform;
+typedef Platform<VirtualClock, KeyboardInput, PreviewOutput, LibcRandom> HeadlessPlatform;
+#endif
+
+#ifdef MICRO_MODE
+struct ArduinoClock
+{
+  static unsigned long millis() { return ::millis(); }
+};
+
+// The turn buttons, the mode switch and the three dials
+struct BoardInput
+{
+  static void begin()
+  {
+#ifdef __AVR__
+    traceLog.begin();
+#endif
+    pinMode(4, INPUT_PULLUP);
+    pinMode(5, INPUT_PULLUP);
+    pinMode(6, INPUT_PULLUP);
+    // Initialize analog pins
+    pinMode(DIAL_PIN_X, INPUT_PULLUP);
+    pinMode(DIAL_PIN_Y, INPUT_PULLUP);
+    pinMode(DIAL_PIN_SPEED, INPUT_PULLUP);
+  }
+  static bool rainbowSwitch() { return digitalRead(6); }
+  static byte direction()
+  {
+    if (digitalRead(4))
+    {
+      return LEFT;
+    }
+    if (digitalRead(5))
+    {
+      return RIGHT;
+    }
+    return STRAIGHT;
+  }
+  static int revolutionMs()
+  {
+    float speedPercent = 1 - (analogRead(DIAL_PIN_SPEED) / 1024.0);
+    int slowestSpeed = 500;
+    int fastestSpeed = 10000;
+    return speedPercent * (fastestSpeed - slowestSpeed) + slowestSpeed;
+  }
+  static void readCenter(float &x, float &y)
+  {
+    x = analogRead(DIAL_PIN_X) / 1024.0;
+    y = analogRead(DIAL_PIN_Y) / 1024.0;
+  }
+};
+
+struct StripOutput
+{
+  static void begin()
+  {
+    strip.begin();            // INITIALIZE NeoPixel strip object (REQUIRED)
+    strip.show();             // Turn OFF all pixels ASAP
+    strip.setBrightness(255); // Set BRIGHTNESS to about 1/5 (max = 255)
+  }
+  // The output stage has already written the frame into the strip's buffer
+  static void present() { strip.show(); }
+};
+
+typedef Platform<ArduinoClock, BoardInput, StripOutput, ArduinoRandom> MicroPlatform;
+#endif
+
+const int SNAKE_STEP_MS = 500;
+const int LOSS_FLASH_MS = 200;
+const int CHERRY_BLINK_MS = 250;
+
+BOARD_LOCAL unsigned long startedVisualizationMs = 0;
+BOARD_LOCAL int countdownToPollSpeed = 20; // Prevent polling every frame.
+BOARD_LOCAL int msPerVizualizationRotation = 5000;
+
+// Swaps the running timeline tasks when the mode switch changes
+BOARD_LOCAL bool modeStarted = false;
+BOARD_LOCAL bool wasRainbowMode = false;
+
+// The game, built for one platform. A board's state is in BOARD_LOCAL globals, so on the laptop each
+// thread can run a board of its own (see --boards). What the boards share, the lines and the strip
+// layout, is set up once by setupShared() and only read after that.
+template <class P>
+class Game
+{
+public:
+  // unsigned long like millis(), since int is 16 bits on the AVR and would go negative after 32 s
+  static unsigned long getMilliCount() { return P::Clock::millis(); }
+
+  static float getPercentThroughVisualization()
+  {
+    unsigned long milliCount = getMilliCount();
+    countdownToPollSpeed--;
+    if (countdownToPollSpeed < 0)
+    {
+      msPerVizualizationRotation = P::Input::revolutionMs();
+      countdownToPollSpeed = 20;
+    }
+#ifdef LAPTOP_MODE
+    if (sharedClock.active())
+    {
+      return sharedClock.phase(msPerVizualizationRotation);
+    }
+#endif
+    unsigned long nSpan = milliCount - startedVisualizationMs;
+    if (nSpan > (unsigned long)msPerVizualizationRotation)
+    {
+      startedVisualizationMs = milliCount;
+      nSpan = 0;
+    }
+
+    int ms = nSpan % msPerVizualizationRotation; // ms is between 0 and msPerVizualizationRotation
+    float percent = ms / (float)msPerVizualizationRotation;
+    return percent;
+  }
+
+  static void updateRainbow()
+  {
+    P::Input::readCenter(rainbowCenterX, rainbowCenterY);
+
+    if (startedVisualizationMs == 0)
+    {
+      startedVisualizationMs = getMilliCount();
+    }
+
+    float percentThroughVisualization = getPercentThroughVisualization();
+    word t = percentThroughVisualization * 65535;
+#ifdef LAPTOP_MODE
+    // word is 32 bits on the laptop, so wrap by hand; effects take t as 0-65535
+    int hueShift = (liveSettings.hueShift % 360 + 360) % 360;
+    t = (word)((t + (long)hueShift * 65536 / 360) & 0xFFFF);
+#endif
+    PROFILE_SCOPE("effect");
+    effects.render(backgroundLayer, t);
+  }
+
+  // Advance the snake one step
+  static void tick()
+  {
+    PROFILE_SCOPE("tick");
+#ifdef MOCK_MICRO
+    mockTicks.push_back(mockMicros());
+#endif
+#ifdef LAPTOP_MODE
+    tickJitter.interval(monotonicMicros());
+#endif
+    byte turn = P::Input::direction();
+    if (turn != STRAIGHT)
+    {
+      traceLog.record(TRACE_TURN, turn, getMilliCount());
+    }
+    snake.move(turn);
+    direction = STRAIGHT;
+    if (lossAnimation > 0)
+    {
+      traceLog.record(TRACE_LOST, snake.length, getMilliCount());
+      timeline.start(lossFlash());
+    }
+    else if (cherry == snake.head())
+    {
+      snake.grow();
+      traceLog.record(TRACE_ATE, snake.length, getMilliCount());
+      randomizeCherry<typename P::Random>();
+    }
+  }
+
+  // Flashes the board while lossAnimation counts down, then starts a new game
+  TIMELINE_TASK(lossFlash)
+  {
+    TASK_BEGIN();
+    while (lossAnimation > 0)
+    {
+      TASK_SLEEP(LOSS_FLASH_MS);
+      lossAnimation--;
+    }
+    snake.reset();
+    randomizeCherry<typename P::Random>();
+#ifdef LAPTOP_MODE
+    // The flash isn't a late tick
+    tickJitter.restart();
+#endif
+    TASK_END();
+  }
+
+  // Moves the snake at a steady pace, pausing while the loss animation plays
+  TIMELINE_TASK(snakeSteps)
+  {
+    TASK_BEGIN();
+    while (true)
+    {
+      TASK_SLEEP(SNAKE_STEP_MS);
+      if (lossAnimation == 0)
+      {
+        tick();
+      }
+    }
+    TASK_END();
+  }
+
+  // Blinks the cherry so it stands out from the snake
+  TIMELINE_TASK(cherryBlink)
+  {
+    TASK_BEGIN();
+    while (true)
+    {
+      TASK_SLEEP(CHERRY_BLINK_MS);
+      cherryVisible = !cherryVisible;
+    }
+    TASK_END();
+  }
+
+  // Fades from the last frame of the previous mode into the new one
+  TIMELINE_TASK(crossfade)
+  {
+    TASK_BEGIN();
+    crossfadeLevel = 0;
+    while (crossfadeLevel < 255 - CROSSFADE_STEP)
+    {
+      TASK_SLEEP(CROSSFADE_STEP_MS);
+      crossfadeLevel += CROSSFADE_STEP;
+    }
+    TASK_SLEEP(CROSSFADE_STEP_MS);
+    crossfadeLevel = 255;
+    TASK_END();
+  }
+
+  static void startMode(bool rainbowMode)
+  {
+    traceLog.record(TRACE_MODE, rainbowMode, getMilliCount());
+    timeline.cancelAll();
+#ifdef LAPTOP_MODE
+    tickJitter.restart();
+#endif
+    memcpy(crossfadeFrom, displayFrame, sizeof(crossfadeFrom));
+    timeline.start(crossfade());
+    if (!rainbowMode)
+    {
+      timeline.start(snakeSteps());
+      timeline.start(cherryBlink());
+      if (lossAnimation > 0)
+      {
+        timeline.start(lossFlash());
+      }
+    }
+    modeStarted = true;
+    wasRainbowMode = rainbowMode;
+  }
+
+  // What every board shares: the inputs, the line topology, the strip layout and the output
+  static void setupShared()
+  {
+    P::Input::begin();
+    P::Random::begin();
+    initLines();
+    compileStripLayout(stripLayout, sizeof(stripLayout) / sizeof(StripRun));
+#ifdef LAPTOP_MODE
+    if (mappedLayout.apply())
+    {
+      // Effects place themselves on the lines when they start
+      effects.select(effects.current());
+    }
+#endif
+    // The preview is laid out from the lines and strip layout
+    P::Output::begin();
+  }
+
+  // Starts the calling thread's board
+  static void setupBoard()
+  {
+    snake.reset();
+    randomizeCherry<typename P::Random>();
+  }
+
+  static void setup()
+  {
+    setupShared();
+    setupBoard();
+  }
+
+#ifdef LAPTOP_MODE
+  // Swaps in what the config watcher has built. The game carries on if the board's lines join up the
+  // same way as before, and starts over if not.
+  static void takeReload()
+  {
+    Reload *reload = configWatcher.take();
+    if (reload == NULL)
+    {
+      return;
+    }
+    bool sameTopology = reload->board.lineCount == lineCount() &&
+                        memcmp(reload->board.next, snakeNext, sizeof(snakeNext)) == 0;
+    useBoardTables(reload->board);
+    std::swap(preview, reload->preview);
+    std::swap(previewLedLine, reload->previewLedLine);
+    if (!sameTopology)
+    {
+      snake.reset();
+      lossAnimation = 0;
+      randomizeCherry<typename P::Random>();
+    }
+    bool effectChanged = reload->settings.effect >= 0 && reload->settings.effect != liveSettings.effect;
+    liveSettings = reload->settings;
+    msPerVizualizationRotation = liveSettings.revolutionMs;
+    // Effects place themselves on the lines when they start
+    effects.select(effectChanged ? liveSettings.effect : effects.current());
+    configWatcher.retire(reload);
+  }
+#endif
+
+  static void loop()
+  {
+    PROFILE_SCOPE("loop");
+#ifdef LAPTOP_MODE
+    takeReload();
+#endif
+    bool rainbowMode = P::Input::rainbowSwitch();
+    if (!modeStarted || rainbowMode != wasRainbowMode)
+    {
+      startMode(rainbowMode);
+    }
+
+    {
+      PROFILE_SCOPE("timeline");
+      timeline.run(getMilliCount());
+    }
+
+    updateRainbow();
+    if (!rainbowMode)
+    {
+      assignColors();
+    }
+    composeFrame(rainbowMode);
+    PROFILE_SCOPE("outputStage");
+    outputStage.process(displayFrame, stripLedLine, stripLedPosition, stripBuffer(), LED_COUNT);
+#ifdef LAPTOP_MODE
+    framePublisher.publish(displayFrame, 2 * lineCount(), stripBuffer());
+#endif
+
+    P::Output::present();
+  }
+};
+
+#ifdef MICRO_MODE
+// The Arduino core's entry points
+void setup() { Game<MicroPlatform>::setup(); }
+void loop() { Game<MicroPlatform>::loop(); }
+#endif
+
+#ifdef LAPTOP_MODE
+// Appends the ops that turn previous into frame, in the format AnimationEffect plays
+void encodeAnimationFrame(const Rgb *previous, const Rgb *frame, byte entries, std::vector<byte> &out)
+{
+  byte entry = 0;
+  while (entry < entries)
+  {
+    bool changed = frame[entry] != previous[entry];
+    byte count = 1;
+    while (entry + count < entries && count < 128 && (frame[entry + count] != previous[entry + count]) == changed)
+    {
+      count++;
+    }
+    out.push_back((changed ? 0x80 : 0) | (count - 1));
+    for (byte i = 0; changed && i < count; i++)
+    {
+      Rgb color = frame[entry + i];
+      out.push_back(rgbRed(color));
+      out.push_back(rgbGreen(color));
+      out.push_back(rgbBlue(color));
+    }
+    entry += count;
+  }
+}
+
+// Renders one revolution of an effect and writes it as an animation, either as a binary file or,
+// when the path ends in .h, as a PROGMEM array to build into the micro with -DCOMPILED_ANIMATION.
+//   --compile-animation EFFECT FRAMES FILE
+int compileAnimation(int argc, const char *argv[])
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "usage: --compile-animation EFFECT FRAMES FILE\n");
+    return 1;
+  }
+  int frameCount = atoi(argv[1]);
+  const char *path = argv[2];
+  if (frameCount < 1 || frameCount > 65535)
+  {
+    fprintf(stderr, "FRAMES must be between 1 and 65535\n");
+    return 1;
+  }
+  srand(1);
+  initLines();
+  effects.select(atoi(argv[0]));
+
+  byte entries = 2 * lineCount();
+  std::vector<Rgb> frames(frameCount * entries);
+  for (int i = 0; i < frameCount; i++)
+  {
+    effects.render(&frames[i * entries], (unsigned long)i * 65536 / frameCount);
+  }
+
+  std::vector<byte> data = {'P', 'A', entries, (byte)frameCount, (byte)(frameCount >> 8), 0, 0, 0, 0};
+  std::vector<Rgb> black(entries, packRgb(0, 0, 0));
+  encodeAnimationFrame(black.data(), &frames[(frameCount - 1) * entries], entries, data);
+  unsigned long loop = data.size();
+  for (int i = 0; i < 4; i++)
+  {
+    data[5 + i] = loop >> (8 * i);
+  }
+  for (int i = 0; i < frameCount; i++)
+  {
+    const Rgb *previous = &frames[(i + frameCount - 1) % frameCount * entries];
+    encodeAnimationFrame(previous, &frames[i * entries], entries, data);
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+  int length = strlen(path);
+  if (length > 2 && strcmp(path + length - 2, ".h") == 0)
+  {
+    fprintf(file, "// Made by placman --compile-animation %s %s\nconst byte compiledAnimation[] PROGMEM = {", argv[0], argv[1]);
+    for (size_t i = 0; i < data.size(); i++)
+    {
+      fprintf(file, "%s%d,", i % 24 == 0 ? "\n  " : "", data[i]);
+    }
+    fprintf(file, "\n};\n");
+  }
+  else
+  {
+    fwrite(data.data(), 1, data.size(), file);
+  }
+  fclose(file);
+  fprintf(stderr, "%d frames in %zu bytes, %.1f%% of uncompressed\n", frameCount, data.size(),
+          100.0 * data.size() / (frameCount * entries * 3));
+  return 0;
+}
+
+// Loads an animation written by --compile-animation for AnimationEffect to play
+std::vector<byte> loadedAnimation;
+bool loadAnimation(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+  byte buffer[4096];
+  size_t read;
+  loadedAnimation.clear();
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    loadedAnimation.insert(loadedAnimation.end(), buffer, buffer + read);
+  }
+  fclose(file);
+  if (loadedAnimation.size() < ANIMATION_HEADER_SIZE || loadedAnimation[0] != 'P' || loadedAnimation[1] != 'A')
+  {
+    fprintf(stderr, "%s is not an animation\n", path);
+    return false;
+  }
+  animationData = loadedAnimation.data();
+  return true;
+}
+#endif
+
+#ifdef LAPTOP_MODE
+// A stretch of the strip, as StripRun but for layouts of any size
+struct LayoutRun
+{
+  uint32_t firstLed;
+  uint32_t firstLine;
+  uint32_t lineCount;
+  uint32_t ledsPerLine;
+  bool reversed;
+  bool serpentine;
+};
+
+// A layout as its text description gives it, before --compile-layout works out the transitions and
+// the strip. The text is one statement a line, and # starts a comment:
+//   line START_X START_Y END_X END_Y       the next line, numbered from 0 in the order given
+//   turns LINE LL LS LR RL RS RR           the lines a snake on LINE moves onto, as initLine() takes them
+//   run FIRST_LED FIRST_LINE LINES LEDS_PER_LINE [reversed] [serpentine]    as a StripRun
+//   leds COUNT                             the strip's length, if it runs past the last run
+struct LayoutSource
+{
+  std::vector<LayoutLine> lines;
+  std::vector<uint32_t> turns; // 6 per line: left then right neighbors, each LEFT, STRAIGHT, RIGHT
+  std::vector<LayoutRun> runs;
+  uint32_t ledCount = 0;
+};
+
+const uint32_t LAYOUT_NO_LINE = 0xFFFFFFFF;
+
+bool readLayoutText(const char *path, LayoutSource &source)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+  char text[256];
+  int number = 0;
+  bool ok = true;
+  while (ok && fgets(text, sizeof(text), file))
+  {
+    number++;
+    char *comment = strchr(text, '#');
+    if (comment != NULL)
+    {
+      *comment = '\0';
+    }
+    char keyword[16] = "";
+    char flags[2][16] = {"", ""};
+    unsigned v[7];
+    int fields = sscanf(text, "%15s", keyword);
+    if (fields < 1)
+    {
+      continue;
+    }
+    if (strcmp(keyword, "line") == 0 && sscanf(text, "%*s %u %u %u %u", &v[0], &v[1], &v[2], &v[3]) == 4 &&
+        std::max(std::max(v[0], v[1]), std::max(v[2], v[3])) <= 0xFFFF)
+    {
+      LayoutLine line = {(uint16_t)v[0], (uint16_t)v[1], (uint16_t)v[2], (uint16_t)v[3]};
+      source.lines.push_back(line);
+    }
+    else if (strcmp(keyword, "turns") == 0 &&
+             sscanf(text, "%*s %u %u %u %u %u %u %u", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]) == 7 &&
+             v[0] < LAYOUT_MAX_LINES)
+    {
+      if (source.turns.size() < (v[0] + 1) * 6)
+      {
+        source.turns.resize((v[0] + 1) * 6, LAYOUT_NO_LINE);
+      }
+      std::copy(v + 1, v + 7, &source.turns[v[0] * 6]);
+    }
+    else if (strcmp(keyword, "run") == 0 &&
+             sscanf(text, "%*s %u %u %u %u %15s %15s", &v[0], &v[1], &v[2], &v[3], flags[0], flags[1]) >= 4 &&
+             v[3] > 0)
+    {
+      LayoutRun run = {v[0], v[1], v[2], v[3], false, false};
+      for (const char *flag : flags)
+      {
+        run.reversed |= strcmp(flag, "reversed") == 0;
+        run.serpentine |= strcmp(flag, "serpentine") == 0;
+      }
+      source.runs.push_back(run);
+    }
+    else if (strcmp(keyword, "leds") == 0 && sscanf(text, "%*s %u", &v[0]) == 1)
+    {
+      source.ledCount = v[0];
+    }
+    else
+    {
+      fprintf(stderr, "%s:%d: can't read \"%s\"\n", path, number, strtok(text, "\r\n"));
+      ok = false;
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+// The built-in board, as a layout source
+void boardLayoutSource(LayoutSource &source)
+{
+  initLines();
+  for (byte i = 0; i < sizeof(lines) / sizeof(Line); i++)
+  {
+    LayoutLine line = {lines[i].startX(), lines[i].startY(), lines[i].endX(), lines[i].endY()};
+    source.lines.push_back(line);
+    for (Line **neighbors : {lines[i].leftNeighbors, lines[i].rightNeighbors})
+    {
+      for (byte action = 0; action < 3; action++)
+      {
+        source.turns.push_back(neighbors[action]->id());
+      }
+    }
+  }
+  for (const StripRun &run : stripLayout)
+  {
+    LayoutRun layoutRun = {run.firstLed, run.firstLine, run.lineCount, run.ledsPerLine, run.reversed, run.serpentine};
+    source.runs.push_back(layoutRun);
+  }
+  source.ledCount = LED_COUNT;
+}
+
+// Works out the transitions and the strip and lays the file out in out. The transitions follow
+// ReferenceSnake::move()'s rules, as initLines() does for the built-in board.
+bool buildLayout(const LayoutSource &source, std::vector<byte> &out)
+{
+  uint32_t lineCount = source.lines.size();
+  if (lineCount == 0 || lineCount >= LAYOUT_MAX_LINES)
+  {
+    fprintf(stderr, "A layout needs between 1 and %u lines\n", LAYOUT_MAX_LINES - 1);
+    return false;
+  }
+  for (uint32_t i = 0; i < lineCount * 6; i++)
+  {
+    if (i >= source.turns.size() || source.turns[i] >= lineCount)
+    {
+      fprintf(stderr, "Line %u's turns are missing or lead off the board\n", i / 6);
+      return false;
+    }
+  }
+  uint32_t ledCount = source.ledCount;
+  for (const LayoutRun &run : source.runs)
+  {
+    if (run.firstLine + (uint64_t)run.lineCount > lineCount || run.firstLed + (uint64_t)run.lineCount * run.ledsPerLine >= 1u << 31)
+    {
+      fprintf(stderr, "The run from LED %u covers lines that don't exist\n", run.firstLed);
+      return false;
+    }
+    ledCount = std::max(ledCount, run.firstLed + run.lineCount * run.ledsPerLine);
+  }
+  if (sizeof(LayoutHeader) + lineCount * (sizeof(LayoutLine) + 4 * 3 * sizeof(uint32_t)) + (uint64_t)ledCount * sizeof(uint32_t) > 0xFFFFFFFF)
+  {
+    fprintf(stderr, "A layout has to fit in 4 GB\n");
+    return false;
+  }
+
+  LayoutHeader header = {};
+  header.magic = LAYOUT_MAGIC;
+  header.version = LAYOUT_VERSION;
+  header.headerBytes = sizeof(LayoutHeader);
+  header.lineCount = lineCount;
+  header.ledCount = ledCount;
+  header.linesOffset = sizeof(LayoutHeader);
+  header.transitionsOffset = header.linesOffset + lineCount * sizeof(LayoutLine);
+  header.ledsOffset = header.transitionsOffset + lineCount * 4 * 3 * sizeof(uint32_t);
+  header.fileBytes = header.ledsOffset + ledCount * sizeof(uint32_t);
+  out.assign(header.fileBytes, 0);
+  memcpy(&out[0], &header, sizeof(header));
+  memcpy(&out[header.linesOffset], source.lines.data(), lineCount * sizeof(LayoutLine));
+
+  uint32_t *transitions = (uint32_t *)&out[header.transitionsOffset];
+  for (uint32_t i = 0; i < lineCount; i++)
+  {
+    const LayoutLine &line = source.lines[i];
+    for (byte facing = 0; facing < 4; facing++)
+    {
+      bool right = facing & 1;
+      bool up = facing & 2;
+      for (byte action = 0; action < 3; action++)
+      {
+        // Facing down mirrors the turns
+        byte turn = up ? action : action == LEFT ? RIGHT : action == RIGHT ? LEFT : STRAIGHT;
+        uint32_t next = source.turns[i * 6 + (right ? 3 : 0) + turn];
+        const LayoutLine &to = source.lines[next];
+        bool sameLeft = std::min(to.startX, to.endX) == std::min(line.startX, line.endX);
+        bool sameTop = std::min(to.startY, to.endY) == std::min(line.startY, line.endY);
+        bool nextRight = right ? !sameLeft : sameLeft;
+        bool nextUp = up ? !sameTop : sameTop;
+        transitions[(i * 4 + facing) * 3 + action] = next << 2 | (nextRight ? 1 : 0) | (nextUp ? 2 : 0);
+      }
+    }
+  }
+
+  uint32_t *leds = (uint32_t *)&out[header.ledsOffset];
+  std::fill(leds, leds + ledCount, lineCount << 8);
+  for (const LayoutRun &run : source.runs)
+  {
+    for (uint32_t l = 0; l < run.lineCount; l++)
+    {
+      bool backwards = run.reversed != (run.serpentine && (l & 1));
+      for (uint32_t k = 0; k < run.ledsPerLine; k++)
+      {
+        uint32_t along = backwards ? run.ledsPerLine - 1 - k : k;
+        leds[run.firstLed + l * run.ledsPerLine + k] = (run.firstLine + l) << 8 | (along * 2 + 1) * 128 / run.ledsPerLine;
+      }
+    }
+  }
+  return true;
+}
+
+// Converts a text layout into the file --layout maps
+//   --compile-layout TEXT FILE
+int compileLayout(int argc, const char *argv[])
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: --compile-layout TEXT FILE\n");
+    return 1;
+  }
+  LayoutSource source;
+  std::vector<byte> data;
+  LayoutView view;
+  if (!readLayoutText(argv[0], source) || !buildLayout(source, data) ||
+      !validateLayout(data.data(), data.size(), view, argv[1]))
+  {
+    return 1;
+  }
+  FILE *file = fopen(argv[1], "wb");
+  if (file == NULL || fwrite(data.data(), 1, data.size(), file) != data.size() || fclose(file) != 0)
+  {
+    perror(argv[1]);
+    return 1;
+  }
+  fprintf(stderr, "%u lines and %u LEDs in %zu bytes\n", view.header->lineCount, view.header->ledCount, data.size());
+  layoutFitsGame(view, "This build can't play it");
+  return 0;
+}
+
+// Writes the built-in board as a text layout, to start a new one from
+//   --export-layout TEXT
+int exportLayout(int argc, const char *argv[])
+{
+  if (argc < 1)
+  {
+    fprintf(stderr, "usage: --export-layout TEXT\n");
+    return 1;
+  }
+  FILE *file = fopen(argv[0], "w");
+  if (file == NULL)
+  {
+    perror(argv[0]);
+    return 1;
+  }
+  LayoutSource source;
+  boardLayoutSource(source);
+  fprintf(file, "# The built-in board. Convert with --compile-layout and play with --layout.\n");
+  for (const LayoutLine &line : source.lines)
+  {
+    fprintf(file, "line %u %u %u %u\n", line.startX, line.startY, line.endX, line.endY);
+  }
+  fprintf(file, "# Lines a snake moves onto facing left, then facing right: left, straight, right\n");
+  for (size_t i = 0; i < source.lines.size(); i++)
+  {
+    const uint32_t *turns = &source.turns[i * 6];
+    fprintf(file, "turns %zu %u %u %u %u %u %u\n", i, turns[0], turns[1], turns[2], turns[3], turns[4], turns[5]);
+  }
+  for (const LayoutRun &run : source.runs)
+  {
+    fprintf(file, "run %u %u %u %u%s%s\n", run.firstLed, run.firstLine, run.lineCount, run.ledsPerLine,
+            run.reversed ? " reversed" : "", run.serpentine ? " serpentine" : "");
+  }
+  fprintf(file, "leds %u\n", source.ledCount);
+  fclose(file);
+  return 0;
+}
+
+// Maps and checks a layout file, and says how long that took and whether this build can play it
+//   --layout-info FILE
+int layoutInfo(int argc, const char *argv[])
+{
+  if (argc < 1)
+  {
+    fprintf(stderr, "usage: --layout-info FILE\n");
+    return 1;
+  }
+  long long startUs = monotonicMicros();
+  int fd = open(argv[0], O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0)
+  {
+    perror(argv[0]);
+    return 1;
+  }
+  void *data = info.st_size == 0 ? MAP_FAILED : mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  LayoutView view;
+  if (data == MAP_FAILED || !validateLayout((const byte *)data, info.st_size, view, argv[0]))
+  {
+    return 1;
+  }
+  long long checkedUs = monotonicMicros();
+  printf("%s: version %u, %u lines, %u LEDs, %lld bytes, mapped and checked in %lld us\n", argv[0],
+         view.header->version, view.header->lineCount, view.header->ledCount, (long long)info.st_size, checkedUs - startUs);
+  if (layoutFitsGame(view, argv[0]))
+  {
+    printf("%s: fits this build\n", argv[0]);
+  }
+  munmap(data, info.st_size);
+  return 0;
+}
+#endif
+
+#ifdef LAPTOP_MODE
+// Prints the records in a trace, from a file written with --trace or a capture of the micro's serial
+// port at TRACE_BAUD. Bytes that don't start a valid record are skipped, so a capture can start mid-record.
+//   --decode-trace FILE
+int decodeTrace(int argc, const char *argv[])
+{
+  if (argc < 1)
+  {
+    fprintf(stderr, "usage: --decode-trace FILE\n");
+    return 1;
+  }
+  FILE *file = strcmp(argv[0], "-") == 0 ? stdin : fopen(argv[0], "rb");
+  if (file == NULL)
+  {
+    perror(argv[0]);
+    return 1;
+  }
+  const char *names[] = {"?", "turn", "ate", "lost", "mode", "dropped"};
+  byte record[TRACE_RECORD_SIZE];
+  int filled = 0;
+  int value;
+  while ((value = fgetc(file)) != EOF)
+  {
+    record[filled++] = value;
+    if (record[0] != TRACE_SYNC || (filled > 1 && (record[1] == 0 || record[1] > TRACE_DROPPED)))
+    {
+      // Resynchronize on the next sync byte
+      memmove(record, record + 1, --filled);
+      continue;
+    }
+    if (filled < TRACE_RECORD_SIZE)
+    {
+      continue;
+    }
+    word arg = record[2] | record[3] << 8;
+    word ms = record[4] | record[5] << 8;
+    printf("%5u ms  %-8s", ms, names[record[1]]);
+    if (record[1] == TRACE_TURN)
+      printf("%s\n", arg == LEFT ? "left" : arg == RIGHT ? "right" : "straight");
+    else if (record[1] == TRACE_MODE)
+      printf("%s\n", arg ? "rainbow" : "snake");
+    else
+      printf("%u\n", arg);
+    filled = 0;
+  }
+  if (file != stdin)
+  {
+    fclose(file);
+  }
+  return 0;
+}
+#endif
+
+#ifdef LAPTOP_MODE
+// Headless frame dumps. Frames are written as one YUV4MPEG2 (.y4m, 4:4:4) stream or as a stream of
+// concatenated binary PPM images (anything else), either of which ffmpeg and most viewers can read.
+// Each frame is converted straight into one reused buffer and handed to write() in a single call.
+class FrameWriter
+{
+  int _fd;
+  bool _y4m;
+  int _width;
+  int _height;
+  std::vector<byte> _buffer;
+
+  bool writeAll(const byte *data, size_t size)
+  {
+    while (size > 0)
+    {
+      ssize_t written = write(_fd, data, size);
+      if (written <= 0)
+      {
+        return false;
+      }
+      data += written;
+      size -= written;
+    }
+    return true;
+  }
+
+public:
+  FrameWriter(int fd, bool y4m, int width, int height, int fps) : _fd(fd), _y4m(y4m), _width(width), _height(height)
+  {
+    char header[64];
+    int headerLength = 0;
+    if (y4m)
+    {
+      headerLength = snprintf(header, sizeof(header), "FRAME\n");
+      char streamHeader[96];
+      int streamLength = snprintf(streamHeader, sizeof(streamHeader), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=FULL\n",
+                                  width, height, fps);
+      writeAll((const byte *)streamHeader, streamLength);
+    }
+    else
+    {
+      headerLength = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+    }
+    _buffer.resize(headerLength + width * height * 3);
+    memcpy(_buffer.data(), header, headerLength);
+  }
+
+  bool writeFrame(const Rgb *pixels)
+  {
+    int count = _width * _height;
+    byte *out = _buffer.data() + _buffer.size() - count * 3;
+    if (_y4m)
+    {
+      // Full range BT.601, one plane at a time
+      byte *y = out;
+      byte *u = out + count;
+      byte *v = out + 2 * count;
+      for (int i = 0; i < count; i++)
+      {
+        int r = rgbRed(pixels[i]);
+        int g = rgbGreen(pixels[i]);
+        int b = rgbBlue(pixels[i]);
+        y[i] = (77 * r + 150 * g + 29 * b) >> 8;
+        u[i] = (-43 * r - 85 * g + 128 * b + 32768) >> 8;
+        v[i] = (128 * r - 107 * g - 21 * b + 32768) >> 8;
+      }
+    }
+    else
+    {
+      for (int i = 0; i < count; i++)
+      {
+        out[3 * i] = rgbRed(pixels[i]);
+        out[3 * i + 1] = rgbGreen(pixels[i]);
+        out[3 * i + 2] = rgbBlue(pixels[i]);
+      }
+    }
+    return writeAll(_buffer.data(), _buffer.size());
+  }
+};
+
+// Runs the game for a number of frames on a virtual clock and dumps what it draws.
+//   --dump FRAMES FILE [--fps N] [--snake] [--effect N] [--seed N] [--lines] [--gradients] [--animation FILE] [--trace FILE]
+// --lines dumps the composed line gradients (start and end of each line) instead of the preview.
+int runDump(int argc, const char *argv[])
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: --dump FRAMES FILE [--fps N] [--snake] [--effect N] [--seed N] [--lines] [--gradients] [--animation FILE] [--trace FILE] [--layout FILE] [--audio FILE] [--audio-rate HZ]\n");
+    return 1;
+  }
+  int frames = atoi(argv[0]);
+  const char *path = argv[1];
+  int fps = 60;
+  int effect = 0;
+  bool lineFrames = false;
+  const char *audioPath = NULL;
+  int audioRate = 44100;
+  srand(1);
+  for (int i = 2; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+      fps = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--snake") == 0)
+      rainbow = false;
+    else if (strcmp(argv[i], "--effect") == 0 && i + 1 < argc)
+      effect = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+      srand(atoi(argv[++i]));
+    else if (strcmp(argv[i], "--lines") == 0)
+      lineFrames = true;
+    else if (strcmp(argv[i], "--gradients") == 0)
+      previewGradients = true;
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      traceLog.begin(fopen(argv[++i], "wb"));
+    else if (strcmp(argv[i], "--animation") == 0 && i + 1 < argc)
+    {
+      if (!loadAnimation(argv[++i]))
+        return 1;
+      effect = effects.count() - 1;
+    }
+    else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+    {
+      if (!mappedLayout.open(argv[++i]))
+        return 1;
+    }
+    else if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc)
+    {
+      audioPath = argv[++i];
+      effect = SPECTRUM_EFFECT;
+    }
+    else if (strcmp(argv[i], "--audio-rate") == 0 && i + 1 < argc)
+      audioRate = atoi(argv[++i]);
+  }
+  if (audioRate < AUDIO_MIN_RATE || audioRate > AUDIO_MAX_RATE)
+  {
+    fprintf(stderr, "--audio-rate must be between %d and %d\n", AUDIO_MIN_RATE, AUDIO_MAX_RATE);
+    return 1;
+  }
+  if (audioPath != NULL)
+  {
+    if (!audioInput.open(audioPath, audioRate))
+    {
+      return 1;
+    }
+    // Audio is fed in just before each frame here, so this is the analysis and drawing alone
+    audioLatency.begin(1000000 / get_max(fps, 1));
+  }
+
+  int fd = strcmp(path, "-") == 0 ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    perror(path);
+    return 1;
+  }
+  int length = strlen(path);
+  bool y4m = length > 4 && strcmp(path + length - 4, ".y4m") == 0;
+
+  Game<HeadlessPlatform>::setup();
+  effects.select(effect);
+
+  FrameWriter writer(fd, y4m, lineFrames ? 2 * lineCount() : preview.width(), lineFrames ? 1 : preview.height(), fps);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < frames; frame++)
+  {
+    VirtualClock::nowMs = 1 + frame * 1000 / fps;
+    // The audio is read along with the virtual clock rather than in real time
+    audioInput.feedUntil((long long)VirtualClock::nowMs * audioInput.rate() / 1000);
+    Game<HeadlessPlatform>::loop();
+    if (!writer.writeFrame(lineFrames ? displayFrame : preview.pixels()))
+    {
+      perror(path);
+      return 1;
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (fd != STDOUT_FILENO)
+  {
+    close(fd);
+  }
+  traceLog.end();
+  fprintf(stderr, "Dumped %d frames in %.2f s, %.1fx real time\n", frames, seconds, frames / (double)fps / seconds);
+  if (audioLatency.enabled())
+  {
+    audioLatency.report("Audio to rendered frame", stderr);
+  }
+  return 0;
+}
+
+// Reads frames back from a dump written by FrameWriter
+class FrameReader
+{
+  FILE *_file;
+  bool _y4m = false;
+  int _width = 0;
+  int _height = 0;
+  bool _valid = false;
+
+public:
+  FrameReader(FILE *file) : _file(file)
+  {
+    char magic[10] = {};
+    if (fread(magic, 1, 9, _file) != 9)
+    {
+      return;
+    }
+    if (strcmp(magic, "YUV4MPEG2") == 0)
+    {
+      _y4m = true;
+      // Only the size is needed from the stream header
+      int c;
+      while ((c = fgetc(_file)) != EOF && c != '\n')
+      {
+        if ((c == 'W' && fscanf(_file, "%d", &_width) != 1) || (c == 'H' && fscanf(_file, "%d", &_height) != 1))
+        {
+          return;
+        }
+      }
+      _valid = c == '\n' && _width > 0 && _height > 0;
+    }
+    else if (magic[0] == 'P' && magic[1] == '6')
+    {
+      // PPM headers repeat on every frame, so rewind and let next() read them
+      fseek(_file, 0, SEEK_SET);
+      _valid = true;
+    }
+  }
+
+  // False when the file isn't a dump this can read
+  bool valid() { return _valid; }
+
+  int sampleCount() { return _width * _height * 3; }
+
+  // Reads the next frame's samples into frame. Returns false at the end of the stream.
+  bool next(std::vector<byte> &frame)
+  {
+    if (!_valid)
+    {
+      return false;
+    }
+    if (_y4m)
+    {
+      char header[6];
+      if (fread(header, 1, 6, _file) != 6)
+      {
+        return false;
+      }
+    }
+    else if (fscanf(_file, " P6 %d %d 255", &_width, &_height) != 2 || _width <= 0 || _height <= 0 ||
+             fgetc(_file) == EOF)
+    {
+      return false;
+    }
+    frame.resize(sampleCount());
+    return fread(frame.data(), 1, frame.size(), _file) == frame.size();
+  }
+};
+
+// Compares two dumps frame by frame and reports every frame that differs by more than tolerance.
+//   --compare A B [--tolerance N]
+// Exits with 1 when any frame differs, so it can gate visual regressions.
+int runCompare(int argc, const char *argv[])
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: --compare A B [--tolerance N]\n");
+    return 1;
+  }
+  int tolerance = 0;
+  if (argc > 3 && strcmp(argv[2], "--tolerance") == 0)
+  {
+    tolerance = atoi(argv[3]);
+  }
+  FILE *a = fopen(argv[0], "rb");
+  FILE *b = fopen(argv[1], "rb");
+  if (a == NULL || b == NULL)
+  {
+    perror(a == NULL ? argv[0] : argv[1]);
+    return 1;
+  }
+
+  FrameReader readerA(a);
+  FrameReader readerB(b);
+  if (!readerA.valid() || !readerB.valid())
+  {
+    fprintf(stderr, "%s is not a Y4M or PPM dump\n", readerA.valid() ? argv[1] : argv[0]);
+    fclose(a);
+    fclose(b);
+    return 1;
+  }
+  std::vector<byte> frameA;
+  std::vector<byte> frameB;
+  int frame = 0;
+  int differing = 0;
+  while (true)
+  {
+    bool moreA = readerA.next(frameA);
+    bool moreB = readerB.next(frameB);
+    if (!moreA || !moreB)
+    {
+      if (moreA != moreB)
+      {
+        printf("Frame counts differ: %s ends after %d frames\n", moreA ? argv[1] : argv[0], frame);
+        differing++;
+      }
+      break;
+    }
+    if (frameA.size() != frameB.size())
+    {
+      printf("Frame %d: sizes differ\n", frame);
+      differing++;
+      break;
+    }
+    int worst = 0;
+    int changed = 0;
+    for (size_t i = 0; i < frameA.size(); i++)
+    {
+      int difference = abs(frameA[i] - frameB[i]);
+      if (difference > tolerance)
+      {
+        changed++;
+        worst = get_max(worst, difference);
+      }
+    }
+    if (changed > 0)
+    {
+      printf("Frame %d: %d samples differ, by up to %d\n", frame, changed, worst);
+      differing++;
+    }
+    frame++;
+  }
+  fclose(a);
+  fclose(b);
+  printf("%d of %d frames differ\n", differing, frame);
+  return differing > 0 ? 1 : 0;
+}
+#endif
+
+#ifdef LAPTOP_MODE
+// Differential checks of the optimized kernels against the reference code they replaced, run with
+// --equivalence. Each kernel is driven by the same seeded random inputs through both versions, and
+// the first divergence is reported with the step and seed needed to reproduce it.
+//   Queue vs RingQueue:                 exact, after every push, pop, contains and clear
+//   ReferenceSnake vs Snake/SnakeBatch: exact head, facing, body, deaths and meals
+//   referenceHueColor vs hueColor:      exact, for every hue from -1 to 359
+//   referenceColorWheelGradient vs colorWheelGradient: exact, or within WHEEL_TOLERANCE per channel
+//                                       with FAST_WHEEL
+//   --equivalence [--steps N] [--seed N] [--forever]
+// Built with -DFUZZ it is a libFuzzer target instead, reading its inputs from the fuzzer's bytes.
+
+#ifdef FAST_WHEEL
+// One hue degree is worth up to 255 * 6 / 360 per channel, and the vectorized angle may land a
+// degree off the reference where it crosses a whole degree
+const int WHEEL_TOLERANCE = 5;
+#else
+const int WHEEL_TOLERANCE = 0;
+#endif
+
+// Random inputs for the checks: xorshift32 from a seed, or the bytes of a fuzzer input
+class EquivalenceInput
+{
+  uint32_t _state;
+  const uint8_t *_data;
+  size_t _size;
+  size_t _used = 0;
+
+public:
+  explicit EquivalenceInput(uint32_t seed) : _state(seed == 0 ? 1 : seed), _data(NULL), _size(0) {}
+  EquivalenceInput(const uint8_t *data, size_t size) : _state(1), _data(data), _size(size) {}
+
+  bool exhausted() { return _data != NULL && _used >= _size; }
+
+  uint32_t next()
+  {
+    if (_data != NULL)
+    {
+      uint32_t value = 0;
+      for (int i = 0; i < 4 && _used < _size; i++)
+      {
+        value |= (uint32_t)_data[_used++] << (8 * i);
+      }
+      return value;
+    }
+    _state ^= _state << 13;
+    _state ^= _state >> 17;
+    _state ^= _state << 5;
+    return _state;
+  }
+
+  Line *line() { return &lines[next() % lineCount()]; }
+};
+
+bool equivalenceFailed(const char *kernel, unsigned long step, uint32_t seed, const char *format, ...)
+{
+  fprintf(stderr, "%s: first divergence at step %lu (seed %u): ", kernel, step, seed);
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+  return false;
+}
+
+bool checkQueues(EquivalenceInput &input, unsigned long steps, uint32_t seed)
+{
+  Queue reference;
+  RingQueue ring;
+  for (unsigned long step = 0; step < steps && !input.exhausted(); step++)
+  {
+    uint32_t op = input.next();
+    switch (op % 16)
+    {
+    case 0:
+      reference.clear();
+      ring.clear();
+      break;
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+    case 5:
+    case 6:
+    {
+      Line *popped = reference.popTail();
+      Line *ringPopped = ring.popTail();
+      if (popped != ringPopped)
+      {
+        return equivalenceFailed("queue", step, seed, "popTail() gave line %d, reference %d",
+                                 ringPopped ? ringPopped->id() : -1, popped ? popped->id() : -1);
+      }
+      break;
+    }
+    case 7:
+    case 8:
+    case 9:
+    {
+      Line *line = input.line();
+      if (reference.contains(line) != ring.contains(line))
+      {
+        return equivalenceFailed("queue", step, seed, "contains(%d) is %d, reference %d",
+                                 line->id(), ring.contains(line), reference.contains(line));
+      }
+      break;
+    }
+    default:
+    {
+      Line *line = input.line();
+      reference.push(line);
+      ring.push(line);
+      break;
+    }
+    }
+    if (reference.getLength() != ring.getLength())
+    {
+      return equivalenceFailed("queue", step, seed, "length is %d, reference %d",
+                               ring.getLength(), reference.getLength());
+    }
+    for (byte i = 0; i < reference.getLength(); i++)
+    {
+      if (reference.at(i) != ring.at(i))
+      {
+        return equivalenceFailed("queue", step, seed, "line %d from the tail is %d, reference %d",
+                                 i, ring.at(i)->id(), reference.at(i)->id());
+      }
+    }
+    if (!reference.isempty() && (reference.head() != ring.head() || reference.peekTail() != ring.peekTail()))
+    {
+      return equivalenceFailed("queue", step, seed, "head or tail differs");
+    }
+  }
+  return true;
+}
+
+template <class AnySnake>
+uint32_t snakeOccupancy(AnySnake &snake)
+{
+  uint32_t occupancy = 0;
+  for (byte k = 0; k < snake.body.getLength(); k++)
+  {
+    occupancy |= 1u << snake.body.at(k)->id();
+  }
+  return occupancy;
+}
+
+template <class AnySnake>
+byte snakeFacing(AnySnake &snake)
+{
+  return (snake.facingRight ? 1 : 0) | (snake.facingUp ? 2 : 0);
+}
+
+// Plays random games with all three snakes side by side. The harness places the cherries, so every
+// snake sees the same board; a death or a full board starts everyone over.
+bool checkSnakes(EquivalenceInput &input, unsigned long steps, uint32_t seed)
+{
+  ReferenceSnake reference;
+  Snake snake;
+  SnakeBatch batch(1, seed);
+  uint32_t full = lineCount() == 32 ? 0xFFFFFFFF : (1u << lineCount()) - 1;
+  bool restart = true;
+  Line *food = NULL;
+  for (unsigned long step = 0; step < steps && !input.exhausted(); step++)
+  {
+    if (restart)
+    {
+      reference.reset();
+      snake.reset();
+      reference.facingRight = reference.facingUp = true;
+      snake.facingRight = snake.facingUp = true;
+      batch.reset(NULL, NULL);
+      food = NULL;
+      restart = false;
+    }
+    if (food == NULL)
+    {
+      food = input.line();
+      while (reference.contains(food))
+      {
+        food = &lines[(food->id() + 1) % lineCount()];
+      }
+      batch.setCherry(0, food->id());
+    }
+
+    byte action = input.next() % 3;
+    lossAnimation = 0;
+    reference.move(action);
+    bool referenceDied = lossAnimation > 0;
+    lossAnimation = 0;
+    snake.move(action);
+    bool died = lossAnimation > 0;
+    lossAnimation = 0;
+    SnakeObservation observation;
+    batch.step(&action, &observation);
+    bool batchDied = observation.flags & SNAKE_DIED;
+
+    if (died != referenceDied || batchDied != referenceDied)
+    {
+      return equivalenceFailed("snake", step, seed, "died is %d (batch %d), reference %d",
+                               died, batchDied, referenceDied);
+    }
+    if (referenceDied)
+    {
+      restart = true;
+      continue;
+    }
+    bool referenceAte = reference.head() == food;
+    bool batchAte = observation.flags & SNAKE_ATE;
+    if (snake.head() != reference.head() || observation.head != reference.head()->id())
+    {
+      return equivalenceFailed("snake", step, seed, "head is %d (batch %d), reference %d",
+                               snake.head()->id(), observation.head, reference.head()->id());
+    }
+    if (snakeFacing(snake) != snakeFacing(reference) || observation.facing != snakeFacing(reference))
+    {
+      return equivalenceFailed("snake", step, seed, "facing is %d (batch %d), reference %d",
+                               snakeFacing(snake), observation.facing, snakeFacing(reference));
+    }
+    if (snakeOccupancy(snake) != snakeOccupancy(reference) || observation.occupancy != snakeOccupancy(reference))
+    {
+      return equivalenceFailed("snake", step, seed, "body is %08x (batch %08x), reference %08x",
+                               snakeOccupancy(snake), observation.occupancy, snakeOccupancy(reference));
+    }
+    if (batchAte != referenceAte)
+    {
+      return equivalenceFailed("snake", step, seed, "batch ate is %d, reference %d", batchAte, referenceAte);
+    }
+    if (referenceAte)
+    {
+      reference.grow();
+      snake.grow();
+      food = NULL;
+      restart = snakeOccupancy(reference) == full;
+    }
+  }
+  return true;
+}
 
-  lines[index].leftNeighbors[LEFT] = &lines[leftNeighborLeft];
-  lines[index].leftNeighbors[STRAIGHT] = &lines[leftNeighborStraight];
-  lines[index].leftNeighbors[RIGHT] = &lines[leftNeighborRight];
-  lines[index].rightNeighbors[LEFT] = &lines[rightNeighborLeft];
-  lines[index].rightNeighbors[STRAIGHT] = &lines[rightNeighborStraight];
-  lines[index].rightNeighbors[RIGHT] = &lines[rightNeighborRight];
+bool checkHueTable(uint32_t seed)
+{
+  for (int hue = -1; hue < 360; hue++)
+  {
+    if (hueColor(hue) != referenceHueColor(hue))
+    {
+      return equivalenceFailed("hue", hue + 1, seed, "hueColor(%d) is %06x, reference %06x",
+                               hue, (unsigned)hueColor(hue), (unsigned)referenceHueColor(hue));
+    }
+  }
+  return true;
+}
+
+bool checkColorWheel(EquivalenceInput &input, unsigned long steps, uint32_t seed)
+{
+  Rgb frame[2 * 32];
+  Rgb referenceFrame[2 * 32];
+  for (unsigned long step = 0; step < steps && !input.exhausted(); step++)
+  {
+    float centerX = (input.next() & 0xFFFF) / 65535.0f;
+    float centerY = (input.next() & 0xFFFF) / 65535.0f;
+    float hueOffset = (input.next() & 0xFFFF) * (360 / 65536.0);
+    colorWheelGradient(frame, centerX, centerY, hueOffset);
+    referenceColorWheelGradient(referenceFrame, centerX, centerY, hueOffset);
+    for (byte i = 0; i < 2 * lineCount(); i++)
+    {
+      int difference = get_max(abs(rgbRed(frame[i]) - rgbRed(referenceFrame[i])),
+                               get_max(abs(rgbGreen(frame[i]) - rgbGreen(referenceFrame[i])),
+                                       abs(rgbBlue(frame[i]) - rgbBlue(referenceFrame[i]))));
+      if (difference > WHEEL_TOLERANCE)
+      {
+        return equivalenceFailed("colorWheel", step, seed,
+                                 "line end %d is %06x, reference %06x, for center (%.6f, %.6f) offset %.6f",
+                                 i, (unsigned)frame[i], (unsigned)referenceFrame[i], centerX, centerY, hueOffset);
+      }
+    }
+  }
+  return true;
+}
+
+// The built-in board compiled into a layout and applied has to give the same lines, transition
+// tables and strip as initLines() and compileStripLayout() do. Puts the built-in board back after.
+bool checkLayout(uint32_t seed)
+{
+  initLines();
+  compileStripLayout(stripLayout, sizeof(stripLayout) / sizeof(StripRun));
+  byte next[sizeof(snakeNext)];
+  byte ledLine[LED_COUNT];
+  byte ledPosition[LED_COUNT];
+  byte ledCount[sizeof(lineLedCount)];
+  memcpy(next, snakeNext, sizeof(next));
+  memcpy(ledLine, stripLedLine, sizeof(ledLine));
+  memcpy(ledPosition, stripLedPosition, sizeof(ledPosition));
+  memcpy(ledCount, lineLedCount, sizeof(ledCount));
+
+  LayoutSource source;
+  std::vector<byte> data;
+  LayoutView view;
+  boardLayoutSource(source);
+  if (!buildLayout(source, data) || !validateLayout(data.data(), data.size(), view, "built-in layout") ||
+      !layoutFitsGame(view, "built-in layout"))
+  {
+    return equivalenceFailed("layout", 0, seed, "the built-in board doesn't compile into a layout");
+  }
+  applyLayout(view);
+  bool sameLines = lineCount() == sizeof(lines) / sizeof(Line);
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    sameLines &= lines[i].startX() == source.lines[i].startX && lines[i].startY() == source.lines[i].startY &&
+                 lines[i].endX() == source.lines[i].endX && lines[i].endY() == source.lines[i].endY;
+  }
+  bool same = true;
+  for (int i = 0; i < lineCount() * 4 * 3; i++)
+  {
+    if (snakeNext[i] != next[i])
+    {
+      same = equivalenceFailed("layout", i, seed, "line %d facing %d action %d goes to line %d facing %d, built-in %d facing %d",
+                               i / 12, i / 3 % 4, i % 3, snakeNext[i] >> 2, snakeNext[i] & 3, next[i] >> 2, next[i] & 3);
+      break;
+    }
+  }
+  if (same && (!sameLines || memcmp(ledLine, stripLedLine, sizeof(ledLine)) != 0 ||
+               memcmp(ledPosition, stripLedPosition, sizeof(ledPosition)) != 0 || memcmp(ledCount, lineLedCount, sizeof(ledCount)) != 0))
+  {
+    same = equivalenceFailed("layout", 0, seed, "the lines or the strip differ from the built-in board's");
+  }
+  initLines();
+  compileStripLayout(stripLayout, sizeof(stripLayout) / sizeof(StripRun));
+  return same;
+}
+
+// Runs every check with its own input stream from the seed
+bool checkEquivalence(unsigned long steps, uint32_t seed)
+{
+  EquivalenceInput queueInput(seed);
+  EquivalenceInput snakeInput(seed + 1);
+  EquivalenceInput wheelInput(seed + 2);
+  return checkQueues(queueInput, steps, seed) &&
+         checkSnakes(snakeInput, steps, seed) &&
+         checkHueTable(seed) &&
+         checkColorWheel(wheelInput, steps, seed) &&
+         checkLayout(seed);
+}
+
+int runEquivalence(int argc, const char *argv[])
+{
+  unsigned long steps = 1000000;
+  uint32_t seed = 1;
+  bool forever = false;
+  for (int i = 0; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc)
+    {
+      steps = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+    {
+      seed = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--forever") == 0)
+    {
+      forever = true;
+    }
+  }
+  initLines();
+  do
+  {
+    if (!checkEquivalence(steps, seed))
+    {
+      return 1;
+    }
+    printf("seed %u: %lu steps per kernel, no divergence\n", seed, steps);
+    fflush(stdout);
+    seed++;
+  } while (forever);
+  return 0;
+}
+
+#ifdef FUZZ
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  static bool initialized = false;
+  if (!initialized)
+  {
+    initLines();
+    initialized = true;
+  }
+  // Every kernel reads the whole input from the start
+  EquivalenceInput queueInput(data, size);
+  EquivalenceInput snakeInput(data, size);
+  EquivalenceInput wheelInput(data, size);
+  if (!checkQueues(queueInput, size, 0) || !checkSnakes(snakeInput, size, 0) ||
+      !checkColorWheel(wheelInput, size, 0))
+  {
+    abort();
+  }
+  // Layouts are checked where they lie, so the check mustn't let anything read past the input
+  LayoutView view;
+  if (validateLayout(data, size, view, NULL))
+  {
+    volatile uint16_t lastEnd = view.lines[view.header->lineCount - 1].endY;
+    (void)lastEnd;
+  }
+  return 0;
+}
+#endif
+#endif
+
+#ifdef LAPTOP_MODE
+// Microbenchmarks for the hot paths, run with --bench. Every benchmark is seeded the same way, so
+// runs see the same inputs. Each one is calibrated to take a few milliseconds per sample, sampled
+// BENCHMARK_SAMPLES times, and summarized per operation. Results are written as JSON, one benchmark
+// per line, and --bench-compare flags the ones that got slower than a threshold.
+//   --bench [--json FILE] [--filter TEXT] [--seed N] [--no-counters]
+//   --bench-compare BASELINE RESULTS [--threshold PERCENT]
+const int BENCHMARK_SAMPLES = 15;
+const double BENCHMARK_SAMPLE_NS = 4e6;
+
+// Hardware performance counters for the benchmarks, through perf_event_open on Linux. All counters
+// are opened as one group so they're scheduled together, and counts are scaled up if the kernel had
+// to multiplex them. When counters aren't permitted (perf_event_paranoid, containers, other systems)
+// the benchmarks fall back to timing alone.
+const int PERF_COUNTERS = 5;
+const char *const perfCounterNames[PERF_COUNTERS] = {"cycles", "instructions", "l1dMisses", "llcMisses", "branchMisses"};
+
+class PerfCounters
+{
+  int _fds[PERF_COUNTERS];
+  // Where each open counter's value lands in a group read, or -1 when it couldn't be opened
+  int _slots[PERF_COUNTERS];
+  int _opened = 0;
+
+public:
+  PerfCounters()
+  {
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+      _fds[i] = -1;
+      _slots[i] = -1;
+    }
+  }
+
+  ~PerfCounters()
+  {
+    for (int fd : _fds)
+    {
+      if (fd >= 0)
+        close(fd);
+    }
+  }
+
+  // Returns false, with the reason in error, when not even the cycle counter can be opened
+  bool open(std::string &error)
+  {
+#ifdef __linux__
+    const uint32_t types[PERF_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                           PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+    const uint64_t configs[PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = types[i];
+      attr.config = configs[i];
+      attr.disabled = i == 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      _fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : _fds[0], 0);
+      if (_fds[i] < 0)
+      {
+        if (i == 0)
+        {
+          error = strerror(errno);
+          if (errno == EACCES || errno == EPERM)
+          {
+            error += "; lowering /proc/sys/kernel/perf_event_paranoid to 2 or below allows them";
+          }
+          return false;
+        }
+        continue;
+      }
+      _slots[i] = _opened++;
+    }
+    return true;
+#else
+    error = "needs Linux perf_event_open";
+    return false;
+#endif
+  }
+
+  bool available(int counter) { return _slots[counter] >= 0; }
+
+  void start()
+  {
+#ifdef __linux__
+    ioctl(_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+  }
+
+  // Stops counting and reads every counter, or 0 for the ones that aren't available
+  void stop(double *counts)
+  {
+    for (int i = 0; i < PERF_COUNTERS; i++)
+      counts[i] = 0;
+#ifdef __linux__
+    ioctl(_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t values[3 + PERF_COUNTERS];
+    if (read(_fds[0], values, sizeof(values)) < (ssize_t)(3 * sizeof(uint64_t)))
+    {
+      return;
+    }
+    // values holds the count, time enabled and time running, then each counter
+    double scale = values[2] > 0 ? (double)values[1] / values[2] : 0;
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+      if (_slots[i] >= 0)
+        counts[i] = values[3 + _slots[i]] * scale;
+    }
+#endif
+  }
+};
+
+
+// Keeps the compiler from optimizing a benchmarked result away
+template <class T>
+inline void benchmarkKeep(const T &value)
+{
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct BenchmarkResult
+{
+  std::string name;
+  int size; // Snake length, queue length or batch size, depending on the benchmark
+  long iterations;
+  double min;
+  double median;
+  double mean;
+  double stddev;
+  double max;
+  // What one operation handles size of, such as "steps", for benchmarks reported as a throughput
+  const char *items;
+  // Per operation, over all the samples. Only meaningful when the suite has counters.
+  double counts[PERF_COUNTERS];
+};
+
+class BenchmarkSuite
+{
+  std::vector<BenchmarkResult> _results;
+  const char *_filter;
+  unsigned _seed;
+  PerfCounters _counters;
+  bool _counting = false;
+
+  template <class Body>
+  double sampleNs(Body &body, long iterations)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    body(iterations);
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  }
+
+public:
+  BenchmarkSuite(const char *filter, unsigned seed, bool counters) : _filter(filter), _seed(seed)
+  {
+    std::string error;
+    if (counters && !(_counting = _counters.open(error)))
+    {
+      fprintf(stderr, "Hardware counters unavailable (%s), timing only\n", error.c_str());
+    }
+  }
+
+  // setup() prepares the state body(iterations) works on. body has to run the operation being
+  // measured that many times. When items is given, each operation handles size of them, and the
+  // throughput is reported too.
+  template <class Setup, class Body>
+  void run(const char *name, int size, Setup setup, Body body, const char *items = NULL)
+  {
+    if (_filter && strstr(name, _filter) == NULL)
+    {
+      return;
+    }
+    srand(_seed);
+    setup();
+    long iterations = 1;
+    while (sampleNs(body, iterations) < BENCHMARK_SAMPLE_NS / 2 && iterations < (1L << 30))
+    {
+      iterations *= 2;
+    }
+    std::vector<double> samples(BENCHMARK_SAMPLES);
+    double counts[PERF_COUNTERS];
+    if (_counting)
+    {
+      _counters.start();
+    }
+    for (double &sample : samples)
+    {
+      sample = sampleNs(body, iterations) / iterations;
+    }
+    _counting ? _counters.stop(counts) : (void)memset(counts, 0, sizeof(counts));
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    double squares = 0;
+    for (double sample : samples)
+    {
+      sum += sample;
+      squares += sample * sample;
+    }
+    BenchmarkResult result = {name, size, iterations, samples.front(), samples[samples.size() / 2],
+                              sum / samples.size(), 0, samples.back(), items, {}};
+    result.stddev = sqrt(std::max(0.0, squares / samples.size() - result.mean * result.mean));
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+      result.counts[i] = counts[i] / (iterations * (double)BENCHMARK_SAMPLES);
+    }
+    _results.push_back(result);
+    fprintf(stderr, "%-22s %5d %12.1f ns  +/- %.1f", name, size, result.median, result.stddev);
+    if (items)
+    {
+      fprintf(stderr, "  %.0f %s/sec", size * 1e9 / result.median, items);
+    }
+    if (_counting)
+    {
+      fprintf(stderr, "  %10.1f cycles  %.2f IPC  %.2f L1d  %.2f LLC  %.2f branch misses", result.counts[0],
+              result.counts[0] > 0 ? result.counts[1] / result.counts[0] : 0, result.counts[2], result.counts[3],
+              result.counts[4]);
+    }
+    fprintf(stderr, "\n");
+  }
+
+  void writeJson(FILE *file)
+  {
+    fprintf(file, "{\"seed\":%u,\"unit\":\"ns\",\"counters\":%s,\"benchmarks\":[\n", _seed,
+            _counting ? "true" : "false");
+    for (size_t i = 0; i < _results.size(); i++)
+    {
+      const BenchmarkResult &r = _results[i];
+      fprintf(file, "{\"name\":\"%s\",\"size\":%d,\"iterations\":%ld,\"samples\":%d,\"min\":%.3f,\"median\":%.3f,"
+                    "\"mean\":%.3f,\"stddev\":%.3f,\"max\":%.3f",
+              r.name.c_str(), r.size, r.iterations, BENCHMARK_SAMPLES, r.min, r.median, r.mean, r.stddev, r.max);
+      if (r.items)
+      {
+        fprintf(file, ",\"%s_per_sec\":%.0f", r.items, r.size * 1e9 / r.median);
+      }
+      for (int c = 0; _counting && c < PERF_COUNTERS; c++)
+      {
+        if (_counters.available(c))
+          fprintf(file, ",\"%s\":%.3f", perfCounterNames[c], r.counts[c]);
+      }
+      fprintf(file, "}%s\n", i + 1 < _results.size() ? "," : "");
+    }
+    fprintf(file, "]}\n");
+  }
+};
+
+// Grows the snake to length by wandering at random, starting over whenever it runs into itself
+void benchmarkGrowSnake(byte length)
+{
+  while (true)
+  {
+    snake = Snake();
+    snake.reset();
+    snake.length = length;
+    lossAnimation = 0;
+    for (int step = 0; step < 500 && lossAnimation == 0 && snake.body.getLength() < length; step++)
+    {
+      snake.move(rand() % 3);
+    }
+    if (lossAnimation == 0 && snake.body.getLength() == length)
+    {
+      return;
+    }
+  }
+}
+
+int runBenchmarks(int argc, const char *argv[])
+{
+  const char *jsonPath = NULL;
+  const char *filter = NULL;
+  unsigned seed = 1;
+  bool counters = true;
+  for (int i = 0; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--no-counters") == 0)
+      counters = false;
+    if (i + 1 >= argc)
+      break;
+    if (strcmp(argv[i], "--json") == 0)
+      jsonPath = argv[++i];
+    else if (strcmp(argv[i], "--filter") == 0)
+      filter = argv[++i];
+    else if (strcmp(argv[i], "--seed") == 0)
+      seed = atoi(argv[++i]);
+  }
+  BenchmarkSuite suite(filter, seed, counters);
+  initLines();
+  compileStripLayout(stripLayout, sizeof(stripLayout) / sizeof(StripRun));
+
+  // Random inputs, shared by the benchmarks that take them
+  const int INPUTS = 1024;
+  static float inputs[INPUTS][4];
+  static byte directions[INPUTS];
+  static byte lineIndexes[INPUTS];
+  Snake start;
+  Queue queue;
+  RingQueue ring;
+  Rgb frame[2 * 32];
+  std::function<void()> makeInputs = [&]() {
+    for (int i = 0; i < INPUTS; i++)
+    {
+      for (float &input : inputs[i])
+        input = rand() / (float)RAND_MAX;
+      directions[i] = rand() % 3;
+      lineIndexes[i] = rand() % lineCount();
+    }
+  };
+
+  const byte sizes[] = {1, 4, 8, 16};
+  for (byte size : sizes)
+  {
+    suite.run("queue_push_popTail", size, [&]() {
+      makeInputs();
+      queue = Queue();
+      for (byte i = 0; i < size; i++)
+        queue.push(&lines[i]);
+    }, [&](long n) {
+      for (long i = 0; i < n; i++)
+      {
+        queue.push(&lines[lineIndexes[i & (INPUTS - 1)]]);
+        benchmarkKeep(queue.popTail());
+      }
+    });
+    suite.run("queue_contains", size, [&]() {
+      makeInputs();
+      queue = Queue();
+      for (byte i = 0; i < size; i++)
+        queue.push(&lines[i]);
+    }, [&](long n) {
+      for (long i = 0; i < n; i++)
+        benchmarkKeep(queue.contains(&lines[lineIndexes[i & (INPUTS - 1)]]));
+    });
+    suite.run("ringQueue_push_popTail", size, [&]() {
+      makeInputs();
+      ring.clear();
+      for (byte i = 0; i < size; i++)
+        ring.push(&lines[i]);
+    }, [&](long n) {
+      for (long i = 0; i < n; i++)
+      {
+        ring.push(&lines[lineIndexes[i & (INPUTS - 1)]]);
+        benchmarkKeep(ring.popTail());
+      }
+    });
+    suite.run("ringQueue_contains", size, [&]() {
+      makeInputs();
+      ring.clear();
+      for (byte i = 0; i < size; i++)
+        ring.push(&lines[i]);
+    }, [&](long n) {
+      for (long i = 0; i < n; i++)
+        benchmarkKeep(ring.contains(&lines[lineIndexes[i & (INPUTS - 1)]]));
+    });
+    suite.run("snake_move", size, [&]() {
+      makeInputs();
+      benchmarkGrowSnake(size);
+      start = snake;
+    }, [&](long n) {
+      for (long i = 0; i < n; i++)
+      {
+        if (lossAnimation > 0)
+        {
+          snake = start;
+          lossAnimation = 0;
+        }
+        snake.move(directions[i & (INPUTS - 1)]);
+      }
+    });
+    suite.run("randomizeCherry", size, [&]() { benchmarkGrowSnake(size); }, [&](long n) {
+      for (long i = 0; i < n; i++)
+      {
+        randomizeCherry<>();
+        benchmarkKeep(cherry);
+      }
+    });
+    suite.run("assignColors", size, [&]() {
+      benchmarkGrowSnake(size);
+      randomizeCherry<>();
+    }, [&](long n) {
+      for (long i = 0; i < n; i++)
+      {
+        assignColors();
+        benchmarkKeep(snakeLayer[0]);
+      }
+    });
+  }
+
+  suite.run("colorWheel", lineCount(), makeInputs, [&](long n) {
+    for (long i = 0; i < n; i++)
+    {
+      const float *input = inputs[i & (INPUTS - 1)];
+      colorWheel(input[0], input[1], input[2] * 360);
+      benchmarkKeep(lines[0]);
+    }
+  });
+  suite.run("colorWheelGradient", lineCount(), makeInputs, [&](long n) {
+    for (long i = 0; i < n; i++)
+    {
+      const float *input = inputs[i & (INPUTS - 1)];
+      colorWheelGradient(frame, input[0], input[1], input[2] * 360);
+      benchmarkKeep(frame[0]);
+    }
+  });
+  suite.run("referenceColorWheelGradient", lineCount(), makeInputs, [&](long n) {
+    for (long i = 0; i < n; i++)
+    {
+      const float *input = inputs[i & (INPUTS - 1)];
+      referenceColorWheelGradient(frame, input[0], input[1], input[2] * 360);
+      benchmarkKeep(frame[0]);
+    }
+  });
+  // What SpectrumEffect spends analyzing a frame's audio: the window, the FFT and the bands
+  SpectrumAnalyzer analyzer;
+  const int SPECTRUM_WINDOWS = 8;
+  std::vector<float> audio(SPECTRUM_WINDOWS * SPECTRUM_SIZE);
+  suite.run("spectrum_analyze", SPECTRUM_SIZE, [&]() {
+    for (float &sample : audio)
+    {
+      sample = rand() / (float)RAND_MAX * 2 - 1;
+    }
+  }, [&](long n) {
+    for (long i = 0; i < n; i++)
+    {
+      analyzer.analyze(&audio[i % SPECTRUM_WINDOWS * SPECTRUM_SIZE]);
+      benchmarkKeep(analyzer.levels[0]);
+    }
+  });
+  suite.run("getAngle", 1, makeInputs, [&](long n) {
+    for (long i = 0; i < n; i++)
+    {
+      const float *input = inputs[i & (INPUTS - 1)];
+      benchmarkKeep(getAngle(input[0] * 6, input[1] * 6, input[2] * 6, input[3] * 6));
+    }
+  });
+  suite.run("h2rgb", 1, makeInputs, [&](long n) {
+    int r, g, b;
+    for (long i = 0; i < n; i++)
+    {
+      h2rgb(inputs[i & (INPUTS - 1)][0], r, g, b);
+      benchmarkKeep(r + g + b);
+    }
+  });
+  suite.run("hueColor", 1, makeInputs, [&](long n) {
+    for (long i = 0; i < n; i++)
+    {
+      benchmarkKeep(hueColor(lineIndexes[i & (INPUTS - 1)] * 11));
+    }
+  });
+
+  // A whole frame, without a window, stepping the virtual clock 16 ms at a time
+  const bool modes[] = {true, false};
+  for (bool rainbowMode : modes)
+  {
+    suite.run(rainbowMode ? "frame_rainbow" : "frame_snake", lineCount(), [&]() {
+      rainbow = rainbowMode;
+      Game<HeadlessPlatform>::setup();
+    }, [&](long n) {
+      for (long i = 0; i < n; i++)
+      {
+        VirtualClock::nowMs += 16;
+        Game<HeadlessPlatform>::loop();
+      }
+    });
+  }
+
+  // Each stage of a snake mode frame on its own, starting from where a few frames leave off
+  std::function<void()> startFrames = [&]() {
+    rainbow = false;
+    Game<HeadlessPlatform>::setup();
+    for (int i = 0; i < 10; i++)
+    {
+      VirtualClock::nowMs += 16;
+      Game<HeadlessPlatform>::loop();
+    }
+  };
+  suite.run("stage_effect", lineCount(), startFrames, [&](long n) {
+    for (long i = 0; i < n; i++)
+    {
+      VirtualClock::nowMs += 16;
+      Game<HeadlessPlatform>::updateRainbow();
+    }
+  });
+  suite.run("stage_assignColors", lineCount(), startFrames, [&](long n) {
+    for (long i = 0; i < n; i++)
+      assignColors();
+  });
+  suite.run("stage_composeFrame", lineCount(), startFrames, [&](long n) {
+    for (long i = 0; i < n; i++)
+      composeFrame(false);
+  });
+  suite.run("stage_outputStage", LED_COUNT, startFrames, [&](long n) {
+    for (long i = 0; i < n; i++)
+      outputStage.process(displayFrame, stripLedLine, stripLedPosition, stripBuffer(), LED_COUNT);
+  });
+  suite.run("stage_renderPreview", lineCount(), startFrames, [&](long n) {
+    for (long i = 0; i < n; i++)
+      renderPreview();
+  });
+
+  // One step of every game in a batch, also reported as game steps per second
+  const int batchSizes[] = {256, 4096};
+  for (int games : batchSizes)
+  {
+    SnakeBatch batch(games, seed);
+    std::vector<SnakeObservation> observations(games);
+    std::vector<byte> actions(games);
+    std::vector<byte> finished(games);
+    suite.run("snakeBatch_step", games, [&]() {
+      for (int game = 0; game < games; game++)
+      {
+        // Mostly straight, like a real policy
+        actions[game] = rand() % 8 < 6 ? STRAIGHT : (rand() % 2 ? LEFT : RIGHT);
+      }
+    }, [&](long n) {
+      for (long i = 0; i < n; i++)
+      {
+        batch.step(actions.data(), observations.data());
+        for (int game = 0; game < games; game++)
+        {
+          finished[game] = observations[game].flags & SNAKE_DONE;
+        }
+        batch.reset(finished.data(), observations.data());
+      }
+    }, "steps");
+  }
+
+  // Checking a layout much bigger than the board, as --layout does at startup
+  const uint32_t LAYOUT_BENCHMARK_LINES = 30000;
+  LayoutSource bigLayout;
+  std::vector<byte> bigLayoutData;
+  LayoutView bigLayoutView;
+  suite.run("layout_validate", LAYOUT_BENCHMARK_LINES, [&]() {
+    // A zigzag strip of lines, each turning onto the next or the one before
+    for (uint32_t i = 0; i < LAYOUT_BENCHMARK_LINES; i++)
+    {
+      LayoutLine line = {(uint16_t)(i % 1000), (uint16_t)(i / 1000 + i % 2), (uint16_t)(i % 1000 + 1), (uint16_t)(i / 1000 + 1 - i % 2)};
+      bigLayout.lines.push_back(line);
+      uint32_t before = i == 0 ? i : i - 1;
+      uint32_t after = i + 1 == LAYOUT_BENCHMARK_LINES ? i : i + 1;
+      bigLayout.turns.insert(bigLayout.turns.end(), {before, before, before, after, after, after});
+    }
+    LayoutRun run = {0, 0, LAYOUT_BENCHMARK_LINES, 3, false, true};
+    bigLayout.runs.push_back(run);
+    buildLayout(bigLayout, bigLayoutData);
+  }, [&](long n) {
+    for (long i = 0; i < n; i++)
+      benchmarkKeep(validateLayout(bigLayoutData.data(), bigLayoutData.size(), bigLayoutView, NULL));
+  });
+
+  FILE *json = jsonPath ? fopen(jsonPath, "w") : stdout;
+  if (json == NULL)
+  {
+    perror(jsonPath);
+    return 1;
+  }
+  suite.writeJson(json);
+  if (json != stdout)
+  {
+    fclose(json);
+  }
+  return 0;
+}
+
+// Reads the medians back out of a file written by BenchmarkSuite::writeJson()
+bool readBenchmarkMedians(const char *path, std::vector<BenchmarkResult> &results)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), file))
+  {
+    char name[64];
+    BenchmarkResult result = {};
+    const char *median = strstr(line, "\"median\":");
+    if (sscanf(line, "{\"name\":\"%63[^\"]\",\"size\":%d", name, &result.size) == 2 && median)
+    {
+      result.name = name;
+      result.median = atof(median + 9);
+      results.push_back(result);
+    }
+  }
+  fclose(file);
+  return true;
 }
 
-void initLines()
+// Exits with 1 when any benchmark's median got slower than the baseline by more than the threshold
+int compareBenchmarks(int argc, const char *argv[])
 {
-  initLine(0, 10, 9, 9, 23, 1, 22);
-  initLine(1, 23, 0, 22, 17, 2, 18);
-  initLine(2, 17, 1, 18, 28, 3, 29);
-  initLine(3, 28, 2, 29, 15, 15, 4);
-  initLine(4, 3, 15, 15, 5, 5, 5);
-  initLine(5, 29, 6, 30, 4, 4, 4);
-  initLine(6, 18, 7, 19, 29, 5, 30);
-  initLine(7, 22, 8, 21, 18, 6, 19);
-  initLine(8, 9, 9, 9, 22, 7, 21);
-  initLine(9, 10, 10, 0, 8, 8, 8);
-  initLine(10, 11, 11, 11, 9, 9, 0);
-  initLine(11, 10, 10, 10, 24, 12, 23);
-  initLine(12, 24, 11, 23, 16, 13, 17);
-  initLine(13, 16, 12, 17, 27, 14, 28);
-  initLine(14, 27, 13, 28, 15, 15, 15);
-  initLine(15, 14, 14, 14, 3, 4, 4);
-  initLine(16, 25, 25, 26, 12, 17, 13);
-  initLine(17, 12, 16, 13, 1, 18, 2);
-  initLine(18, 1, 17, 2, 7, 19, 6);
-  initLine(19, 7, 18, 6, 20, 31, 31);
-  initLine(20, 21, 21, 21, 19, 31, 31);
-  initLine(21, 8, 22, 7, 20, 20, 20);
-  initLine(22, 0, 23, 1, 8, 21, 7);
-  initLine(23, 11, 24, 12, 0, 22, 1);
-  initLine(24, 25, 25, 25, 11, 23, 12);
-  initLine(25, 24, 24, 24, 26, 26, 16);
-  initLine(26, 25, 25, 16, 27, 27, 27);
-  initLine(27, 26, 26, 26, 13, 28, 14);
-  initLine(28, 13, 27, 14, 2, 29, 3);
-  initLine(29, 2, 28, 3, 6, 30, 5);
-  initLine(30, 6, 29, 5, 31, 31, 31);
-  initLine(31, 19, 20, 20, 30, 30, 30);
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: --bench-compare BASELINE RESULTS [--threshold PERCENT]\n");
+    return 1;
+  }
+  double threshold = argc > 3 && strcmp(argv[2], "--threshold") == 0 ? atof(argv[3]) : 5;
+  std::vector<BenchmarkResult> baseline;
+  std::vector<BenchmarkResult> results;
+  if (!readBenchmarkMedians(argv[0], baseline) || !readBenchmarkMedians(argv[1], results))
+  {
+    return 1;
+  }
+  int regressions = 0;
+  for (const BenchmarkResult &result : results)
+  {
+    for (const BenchmarkResult &base : baseline)
+    {
+      if (base.name == result.name && base.size == result.size)
+      {
+        double change = (result.median - base.median) / base.median * 100;
+        const char *verdict = change > threshold ? "SLOWER" : change < -threshold ? "faster" : "";
+        printf("%-22s %5d %12.1f ns %12.1f ns %+7.1f%%  %s\n", result.name.c_str(), result.size, base.median,
+               result.median, change, verdict);
+        regressions += change > threshold;
+      }
+    }
+  }
+  printf("%d regressions beyond %.1f%%\n", regressions, threshold);
+  return regressions > 0 ? 1 : 0;
 }
+#endif
 
-Snake snake;
+#ifdef LAPTOP_MODE
+// Real-time mode, for Linux installs where the render loop shares the box with other services. The
+// game loop, preview rasterizing included, moves to a simulation thread woken on absolute deadlines
+// at the frame rate. The main thread keeps the window: it hands key presses over and shows the newest
+// finished frame. Each thread can be pinned to a core and given a SCHED_FIFO priority, memory is
+// locked and pre-faulted, and nothing is allocated once the first frame has run. On exit it reports
+// how far wakeups and snake ticks landed from their cadence.
+//   --realtime [--fps N] [--sim-cpu N] [--render-cpu N] [--sim-priority N] [--render-priority N]
+struct RealtimeOptions
+{
+  bool enabled = false;
+  int fps = 60;
+  int simCpu = -1; // -1 leaves the thread to the scheduler
+  int renderCpu = -1;
+  int simPriority = 80;
+  int renderPriority = 70;
+  int effect = -1; // The effect to start on, from --play or --audio
+};
 
-byte lineCount()
+// Key presses from the window thread to the simulation thread, one producer and one consumer
+class KeyMailbox
 {
-  return sizeof(lines) / sizeof(Line);
+  static const byte SIZE = 64;
+  SDL_Keycode _keys[SIZE];
+  std::atomic<byte> _head;
+  std::atomic<byte> _tail;
+
+public:
+  KeyMailbox() : _head(0), _tail(0) {}
+
+  // Drops the key when the mailbox is full
+  void post(SDL_Keycode key)
+  {
+    byte head = _head.load(std::memory_order_relaxed);
+    byte next = (head + 1) % SIZE;
+    if (next != _tail.load(std::memory_order_acquire))
+    {
+      _keys[head] = key;
+      _head.store(next, std::memory_order_release);
+    }
+  }
+
+  bool take(SDL_Keycode &key)
+  {
+    byte tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    key = _keys[tail];
+    _tail.store((tail + 1) % SIZE, std::memory_order_release);
+    return true;
+  }
+};
+
+// Passes rasterized previews from the simulation thread to the window thread through three buffers:
+// one being written, one being shown, and the newest finished one waiting in between. Neither side
+// ever waits for the other.
+class FrameExchange
+{
+  static const byte FRESH = 4;
+  std::vector<Rgb> _buffers[3];
+  byte _back = 0;
+  byte _front = 1;
+  std::atomic<byte> _middle;
+
+public:
+  FrameExchange() : _middle(2) {}
+
+  void allocate(size_t pixels)
+  {
+    for (std::vector<Rgb> &buffer : _buffers)
+    {
+      buffer.assign(pixels, 0);
+    }
+  }
+
+  Rgb *back() { return _buffers[_back].data(); }
+
+  void publish()
+  {
+    _back = _middle.exchange(_back | FRESH, std::memory_order_acq_rel) & 3;
+  }
+
+  // The newest published frame, or NULL when there is none since the last call
+  const Rgb *take()
+  {
+    if (!(_middle.load(std::memory_order_relaxed) & FRESH))
+    {
+      return NULL;
+    }
+    _front = _middle.exchange(_front, std::memory_order_acq_rel) & 3;
+    return _buffers[_front].data();
+  }
+};
+
+KeyMailbox realtimeKeys;
+FrameExchange realtimeFrames;
+std::atomic<bool> realtimeQuit(false);
+// Frame wakeups against their deadlines
+JitterStats wakeJitter(1);
+
+// Rasterizes on the simulation thread and leaves the frame for the window thread
+struct PublishedOutput
+{
+  static void begin()
+  {
+    initPreview();
+    realtimeFrames.allocate(preview.width() * preview.height());
+  }
+  static void present()
+  {
+    PROFILE_SCOPE("draw");
+    renderPreview();
+    memcpy(realtimeFrames.back(), preview.pixels(), preview.width() * preview.height() * sizeof(Rgb));
+    realtimeFrames.publish();
+  }
+};
+
+typedef Platform<SystemClock, KeyboardInput, PublishedOutput, LibcRandom> RealtimePlatform;
+
+// Touches the stack the calling thread will use, so its pages are mapped, and locked, up front
+void prefaultStack()
+{
+  volatile byte stack[256 * 1024];
+  for (size_t i = 0; i < sizeof(stack); i += 4096)
+  {
+    stack[i] = 0;
+  }
 }
-int actualLedCount()
+
+// Locks every page the process has and will get into RAM. Freed memory is kept in the process
+// rather than handed back, so reusing it can't fault.
+void lockMemory()
 {
-  return sizeof(actual_leds) / sizeof(byte);
+#ifdef __GLIBC__
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+#endif
+#ifdef __linux__
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+  {
+    fprintf(stderr, "Can't lock memory (%s)%s\n", strerror(errno),
+            errno == ENOMEM || errno == EPERM ? ", raise the memlock limit (ulimit -l)" : "");
+  }
+#else
+  fprintf(stderr, "Memory locking needs Linux\n");
+#endif
 }
 
-int getRandomLineIndex()
+// Pins the calling thread to cpu, unless it is negative, and asks for SCHED_FIFO at priority. A
+// request that fails is reported and the thread runs without it.
+void makeThreadRealtime(const char *name, int cpu, int priority)
 {
-#ifdef MICRO_MODE
-  return random(0, lineCount() - 1);
+#ifdef __linux__
+  if (cpu >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0)
+    {
+      fprintf(stderr, "Can't pin the %s thread to CPU %d (%s)\n", name, cpu, strerror(error));
+    }
+  }
+  sched_param param = {};
+  param.sched_priority = priority;
+  int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (error != 0)
+  {
+    fprintf(stderr, "Can't give the %s thread SCHED_FIFO priority %d (%s)%s\n", name, priority, strerror(error),
+            error == EPERM ? ", needs CAP_SYS_NICE or an rtprio limit" : "");
+  }
+#else
+  fprintf(stderr, "Real-time scheduling needs Linux, the %s thread runs normally\n", name);
 #endif
-  return rand() % (lineCount()) + 0;
+  prefaultStack();
 }
 
-int getRandomHue()
+#ifdef PROFILE
+// Where the P key and exit save the profile, from --profile
+const char *profilePath = NULL;
+#endif
+
+void handleKey(SDL_Keycode key)
 {
-#ifdef MICRO_MODE
-  return random(0, 359);
+  if (key == SDLK_LEFT)
+  {
+    direction = LEFT;
+  }
+  else if (key == SDLK_RIGHT)
+  {
+    direction = RIGHT;
+  }
+  else if (key == SDLK_SPACE)
+  {
+    rainbow = !rainbow;
+  }
+  else if (key == SDLK_e)
+  {
+    effects.select(effects.current() + 1);
+  }
+  else if (key == SDLK_g)
+  {
+    previewGradients = !previewGradients;
+  }
+#ifdef PROFILE
+  else if (key == SDLK_p && profilePath)
+  {
+    // Save what has been recorded so far without stopping
+    profiler.write(profilePath);
+  }
 #endif
-  return rand() % (359 + 1) + 0;
 }
 
-void randomizeCherry()
+void runSimulation(RealtimeOptions options)
 {
-  cherry = &lines[getRandomLineIndex()];
-  while (snake.contains(cherry))
+  makeThreadRealtime("simulation", options.simCpu, options.simPriority);
+  // The board's state is this thread's
+  Game<RealtimePlatform>::setupBoard();
+  if (options.effect >= 0)
   {
-    cherry = &lines[getRandomLineIndex()];
+    effects.select(options.effect);
   }
+  // The first frame starts the timeline tasks and this thread's profile buffer
+  Game<RealtimePlatform>::loop();
+  unsigned long startupAllocations = heapAllocations.load();
+  const long periodUs = 1000000 / options.fps;
+  wakeJitter.begin(periodUs);
+  tickJitter.begin(SNAKE_STEP_MS * 1000L);
+
+  long long deadlineUs = monotonicMicros();
+  while (!realtimeQuit.load(std::memory_order_relaxed))
+  {
+    deadlineUs += periodUs;
+#ifdef __linux__
+    timespec deadline;
+    deadline.tv_sec = deadlineUs / 1000000;
+    deadline.tv_nsec = deadlineUs % 1000000 * 1000;
+    // steady_clock is CLOCK_MONOTONIC on Linux
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+    {
+    }
+#else
+    std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::microseconds(deadlineUs)));
+#endif
+    long long nowUs = monotonicMicros();
+    wakeJitter.late(nowUs - deadlineUs);
+    if (nowUs - deadlineUs >= periodUs)
+    {
+      // Missed whole frames; start again from now rather than running them back to back
+      deadlineUs = nowUs;
+    }
+
+    SDL_Keycode key;
+    while (realtimeKeys.take(key))
+    {
+      handleKey(key);
+    }
+    Game<RealtimePlatform>::loop();
+  }
+  printf("Allocations after startup: %lu\n", heapAllocations.load() - startupAllocations);
 }
 
-void randomizeColors()
+// Runs the game with the simulation on its own thread until the window closes
+void runRealtime(RealtimeOptions options)
 {
-  for (int i = 0; i < lineCount(); i++)
+  Game<RealtimePlatform>::setupShared();
+  lockMemory();
+  makeThreadRealtime("render", options.renderCpu, options.renderPriority);
+  // Starts this thread's profile buffer before the simulation starts counting allocations
+  PROFILE_INSTANT("realtime", options.fps);
+  std::thread simulation(runSimulation, options);
+
+  bool quit = false;
+  SDL_Event e;
+  while (!quit)
   {
-    lines[i].setHue(getRandomHue());
+    // Short waits, so a new frame is shown within a millisecond of being finished
+    if (SDL_WaitEventTimeout(&e, 1))
+    {
+      do
+      {
+        if (e.type == SDL_QUIT)
+        {
+          quit = true;
+        }
+        if (e.type == SDL_KEYDOWN)
+        {
+          PROFILE_INSTANT("key", e.key.keysym.sym);
+          realtimeKeys.post(e.key.keysym.sym);
+        }
+      } while (SDL_PollEvent(&e));
+    }
+    const Rgb *frame = realtimeFrames.take();
+    if (frame != NULL)
+    {
+      showPreview(frame);
+    }
   }
+  realtimeQuit = true;
+  simulation.join();
+  wakeJitter.report("Frame wakeups");
+  tickJitter.report("Snake ticks");
 }
+#endif
 
-bool clockwiseRainbow = true;
+#ifdef LAPTOP_MODE
+// Tiled boards: --boards N runs N boards in one process and one window. The line topology, strip
+// layout, color tables and the preview's rasterized line shapes are shared. Each board's game state,
+// everything BOARD_LOCAL, belongs to the thread it runs on. Every frame the main thread releases all
+// boards at once, each one renders into its own tile of a shared framebuffer, and the window gets
+// one texture upload and one present. Odd boards play snake on autopilot; even ones show the
+// rainbow, each starting on a different effect. Keys go to every board.
+//   --boards N
 
-// centerX and centerY are 0-1. hueOffset is from 0-360
-void colorWheel(float centerX, float centerY, float hueOffset)
+// Whether this thread's board steers its own snake
+BOARD_LOCAL bool boardAutopilot = false;
+// This thread's board's tile of the tiled framebuffer
+BOARD_LOCAL Rgb *boardTile = NULL;
+int tileStride = PREVIEW_WIDTH;
+
+// Picks the turn that keeps the snake alive and brings it closest to the cherry
+byte autopilotTurn()
 {
-  // Normalize center. Line center is 3,3, far corner is 6,6.
-  centerX = centerX * 6;
-  centerY = centerY * 6;
-  for (byte i = 0; i < lineCount(); i++)
+  const byte turns[] = {STRAIGHT, LEFT, RIGHT};
+  byte facing = (snake.facingRight ? 1 : 0) | (snake.facingUp ? 2 : 0);
+  // The tail moves out of the way this step unless the snake is still growing
+  Line *leaving = snake.body.getLength() >= snake.length ? snake.body.peekTail() : NULL;
+  byte best = STRAIGHT;
+  float bestDistance = 1e9;
+  for (byte turn : turns)
   {
-    // angle will be between 0 and 360
-    float angle = getAngle(centerX, centerY, lines[i].centerX(), lines[i].centerY());
-    float hue = fmod(360 + angle - hueOffset, 360);
-    lines[i].setHue(hue);
+    Line *next = &lines[snakeNext[(snake.head()->id() * 4 + facing) * 3 + turn] >> 2];
+    float distance = cherry == NULL ? 0 : fabs(next->centerX() - cherry->centerX()) + fabs(next->centerY() - cherry->centerY());
+    if (snake.contains(next) && next != leaving)
+    {
+      distance += 1000;
+    }
+    if (distance < bestDistance)
+    {
+      best = turn;
+      bestDistance = distance;
+    }
   }
+  return best;
 }
 
-// Direction is 1-4 (moving left, up, down or right), offset is 0-359
-// void orthagonalRainbowSwipe(int direction, int offset) {
-//   int spread = 360;
-//   int max = 6; // max x or y of line
-//   for(int i = 0; i <= max; i++) {
+struct TiledInput : KeyboardInput
+{
+  static byte direction() { return boardAutopilot ? autopilotTurn() : ::direction; }
+};
+
+struct TiledOutput
+{
+  static void begin() { initPreview(); }
+  static void present()
+  {
+    PROFILE_SCOPE("draw");
+    renderPreview(boardTile, tileStride);
+  }
+};
 
-//     int hue =
+typedef Platform<SystemClock, TiledInput, TiledOutput, LibcRandom> TiledPlatform;
 
-//     for(int lineI = 0; lineI < lineCount(); lineI++) {
-//       Line* line = &lines[linesI];
-//       if (direction == 0) { // left
-//         if (line->startX() == i) {
-//           line->setHue();
-//         }
-//       } else if (direction == 1) {// up
-//         if (line->startY() == i) {
+class TiledBoards
+{
+  int _count;
+  int _columns;
+  int _rows;
+  std::vector<Rgb> _pixels;
+  std::vector<std::thread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _started;
+  std::condition_variable _finished;
+  unsigned long _frame = 0;
+  int _running = 0;
+  bool _quit = false;
+  std::vector<SDL_Keycode> _keys;
 
-//         }
-//       }
-//     }
-//   }
-// }
+  void runBoard(int index, int effect)
+  {
+    boardTile = &_pixels[(index / _columns) * PREVIEW_HEIGHT * width() + (index % _columns) * PREVIEW_WIDTH];
+    boardAutopilot = index % 2 == 1;
+    rainbow = !boardAutopilot;
+    Game<TiledPlatform>::setupBoard();
+    effects.select(effect >= 0 ? effect : index / 2);
 
-#ifdef LAPTOP_MODE
-int main(int argc, const char *argv[])
-{ // Only called for LAPTOP_MODE
-  SDL_Init(SDL_INIT_VIDEO);
-  _window = SDL_CreateWindow("PLAC-MAN", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 700, 500, SDL_WINDOW_RESIZABLE);
-  renderer = SDL_CreateRenderer(_window, -1, SDL_RENDERER_ACCELERATED);
+    unsigned long frame = 0;
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _started.wait(lock, [&]() { return _quit || _frame != frame; });
+        if (_quit)
+        {
+          return;
+        }
+        frame = _frame;
+      }
+      // _keys stays put until every board has finished the frame
+      for (SDL_Keycode key : _keys)
+      {
+        handleKey(key);
+      }
+      Game<TiledPlatform>::loop();
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (--_running == 0)
+      {
+        _finished.notify_one();
+      }
+    }
+  }
+
+public:
+  explicit TiledBoards(int count) : _count(count)
+  {
+    _columns = ceil(sqrt(count));
+    _rows = (count + _columns - 1) / _columns;
+    _pixels.assign(width() * height(), packRgb(0, 0, 0));
+    tileStride = width();
+  }
+
+  ~TiledBoards() { stop(); }
+
+  int width() { return _columns * PREVIEW_WIDTH; }
+  int height() { return _rows * PREVIEW_HEIGHT; }
+  const Rgb *pixels() { return _pixels.data(); }
+
+  // Starts every board's thread. effect is the one every board starts on, or -1 to spread them out.
+  void start(int effect)
+  {
+    Game<TiledPlatform>::setupShared();
+    for (int i = 0; i < _count; i++)
+    {
+      _threads.push_back(std::thread(&TiledBoards::runBoard, this, i, effect));
+    }
+  }
+
+  // Runs one frame of every board, after handing them keys, and returns when all are done
+  void frame(const std::vector<SDL_Keycode> &keys)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _keys = keys;
+      _running = _count;
+      _frame++;
+    }
+    _started.notify_all();
+    std::unique_lock<std::mutex> lock(_mutex);
+    _finished.wait(lock, [&]() { return _running == 0; });
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _quit = true;
+    }
+    _started.notify_all();
+    for (std::thread &thread : _threads)
+    {
+      thread.join();
+    }
+    _threads.clear();
+  }
+};
+
+// Runs count boards in the window until it closes
+void runTiled(int count, int effect)
+{
+  TiledBoards boards(count);
+  SDL_DestroyTexture(previewTexture);
+  previewTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                     boards.width(), boards.height());
+  boards.start(effect);
+
+  std::vector<SDL_Keycode> keys;
+  bool quit = false;
   SDL_Event e;
-  setup();
+  while (!quit)
+  {
+    keys.clear();
+    while (SDL_PollEvent(&e))
+    {
+      if (e.type == SDL_QUIT)
+      {
+        quit = true;
+      }
+      if (e.type == SDL_KEYDOWN)
+      {
+        PROFILE_INSTANT("key", e.key.keysym.sym);
+        // The preview mode and profile are the process's, not a board's
+        if (e.key.keysym.sym == SDLK_g || e.key.keysym.sym == SDLK_p)
+        {
+          handleKey(e.key.keysym.sym);
+        }
+        else
+        {
+          keys.push_back(e.key.keysym.sym);
+        }
+      }
+    }
+
+    boards.frame(keys);
+    PROFILE_SCOPE("draw");
+    SDL_UpdateTexture(previewTexture, NULL, boards.pixels(), boards.width() * sizeof(Rgb));
+    SDL_RenderCopy(renderer, previewTexture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+  }
+  boards.stop();
+}
+#endif
+
+#ifdef LAPTOP_MODE
+// Reads the frames another plac-man publishes with --publish the way an external consumer would:
+// mapped read-only, read in place, polling the newest frame number rather than waiting on a syscall
+// per frame. Reports once a second how many frames it read, missed because they were overwritten
+// first, or caught mid-write, and how long after publishing they were read.
+//   --watch NAME [--frames N]
+int watchFrames(int argc, const char *argv[])
+{
+  if (argc < 1)
+  {
+    fprintf(stderr, "usage: --watch NAME [--frames N]\n");
+    return 1;
+  }
+  unsigned long frames = argc > 2 && strcmp(argv[1], "--frames") == 0 ? strtoul(argv[2], NULL, 10) : 0;
+  int fd = shm_open(argv[0], O_RDONLY, 0);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0)
+  {
+    perror(argv[0]);
+    return 1;
+  }
+  if (info.st_size < (off_t)sizeof(SharedFrames))
+  {
+    fprintf(stderr, "%s: too small for a frame ring\n", argv[0]);
+    return 1;
+  }
+  void *memory = mmap(NULL, sizeof(SharedFrames), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED)
+  {
+    perror(argv[0]);
+    return 1;
+  }
+  const SharedFrames *shared = (const SharedFrames *)memory;
+  if (shared->magic != SHARED_FRAMES_MAGIC || shared->version != SHARED_FRAMES_VERSION ||
+      shared->slotBytes != sizeof(SharedFrameSlot) || shared->slots != SHARED_FRAME_SLOTS)
+  {
+    fprintf(stderr, "%s: not a frame ring this build can read\n", argv[0]);
+    return 1;
+  }
 
-  bool quit = false;
-  while (!quit)
+  uint64_t last = shared->latest.load(std::memory_order_acquire);
+  unsigned long total = 0;
+  unsigned long read = 0;
+  unsigned long missed = 0;
+  unsigned long torn = 0;
+  long long latencySumUs = 0;
+  long long worstLatencyUs = 0;
+  unsigned long level = 0;
+  long long reportAtUs = monotonicMicros() + 1000000;
+  while (frames == 0 || total < frames)
   {
-    while (SDL_PollEvent(&e))
+    uint64_t latest = shared->latest.load(std::memory_order_acquire);
+    if (latest == last)
     {
-      if (e.type == SDL_QUIT)
+      usleep(500);
+    }
+    uint64_t first = latest >= SHARED_FRAME_SLOTS && latest - SHARED_FRAME_SLOTS + 1 > last + 1 ? latest - SHARED_FRAME_SLOTS + 1 : last + 1;
+    missed += first - (last + 1);
+    for (uint64_t frame = first; frame <= latest; frame++)
+    {
+      const SharedFrameSlot &slot = shared->slot[frame % SHARED_FRAME_SLOTS];
+      uint32_t before = slot.sequence.load(std::memory_order_acquire);
+      // Consume in place: the strip's overall level stands in for driving LEDs or drawing
+      unsigned long sum = 0;
+      for (int i = 0; i < LED_COUNT * 3; i++)
       {
-        quit = true;
+        sum += slot.strip[i];
       }
-      if (e.type == SDL_KEYDOWN)
+      uint64_t slotFrame = slot.frame;
+      long long timeUs = slot.timeUs;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if ((before & 1) || slot.sequence.load(std::memory_order_relaxed) != before || slotFrame != frame)
       {
-        if (e.key.keysym.sym == SDLK_LEFT)
-        {
-          direction = LEFT;
-        }
-        else if (e.key.keysym.sym == SDLK_RIGHT)
-        {
-          direction = RIGHT;
-        }
-        else if (e.key.keysym.sym == SDLK_SPACE)
-        {
-          rainbow = !rainbow;
-        }
+        torn++;
+        continue;
       }
+      long long latencyUs = monotonicMicros() - timeUs;
+      latencySumUs += latencyUs;
+      worstLatencyUs = std::max(worstLatencyUs, latencyUs);
+      level = sum / (LED_COUNT * 3);
+      read++;
     }
+    total += latest - last;
+    last = latest;
 
-    loop();
-  }
-
-  if (renderer)
-  {
-    SDL_DestroyRenderer(renderer);
+    if (monotonicMicros() >= reportAtUs || (frames != 0 && total >= frames))
+    {
+      printf("frame %llu: %lu read, %lu missed, %lu torn, %.0f us latency on average, %lld us at worst, strip level %lu\n",
+             (unsigned long long)last, read, missed, torn, read ? (double)latencySumUs / read : 0.0, worstLatencyUs, level);
+      fflush(stdout);
+      read = missed = torn = 0;
+      latencySumUs = worstLatencyUs = 0;
+      reportAtUs += 1000000;
+    }
   }
-  SDL_DestroyWindow(_window);
-  SDL_Quit();
-
+  munmap(memory, sizeof(SharedFrames));
   return 0;
 }
-#endif
 
-void assignColors()
+// Reports once a second, for each process following a --lead-clock, how many rainbow frames it drew,
+// how long before each one the leader last drew its own, and how far apart in hue the phases the two
+// frames drew were. Both are zero only if the windows draw at the same instants; following keeps them
+// from growing past a frame however long the processes run, and a follower reading a stale anchor
+// shows up as hue apart that the lag doesn't account for.
+//   --watch-clock NAME [--seconds N]
+int watchClock(int argc, const char *argv[])
 {
-  // Handle the loss case and early out first
-  if (lossAnimation > 0)
+  if (argc < 1)
   {
-    for (byte i = 0; i < lineCount(); i++)
-    {
-      lines[i].setHue(lossAnimation % 2 == 0 ? RED_HUE : -1);
-    }
-    return;
+    fprintf(stderr, "usage: --watch-clock NAME [--seconds N]\n");
+    return 1;
   }
-
-  // Assign each light a default hue
-  for (byte i = 0; i < lineCount(); i++)
+  long seconds = argc > 2 && strcmp(argv[1], "--seconds") == 0 ? atol(argv[2]) : 0;
+  int fd = shm_open(argv[0], O_RDONLY, 0);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0)
   {
-    lines[i].setHue(-1); //i * (360 / lineCount()));
+    perror(argv[0]);
+    return 1;
   }
-
-  if (cherry != NULL)
+  void *memory = info.st_size < (off_t)sizeof(SharedClock) ? MAP_FAILED : mmap(NULL, sizeof(SharedClock), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  const SharedClock *shared = (const SharedClock *)memory;
+  if (memory == MAP_FAILED || shared->magic != SHARED_CLOCK_MAGIC || shared->version != SHARED_CLOCK_VERSION ||
+      shared->followers != SHARED_CLOCK_FOLLOWERS)
   {
-    cherry->setHue(RED_HUE);
+    fprintf(stderr, "%s: not a clock this build can read\n", argv[0]);
+    return 1;
   }
 
-  int diff = BLUE_HUE - GREEN_HUE;
-  int increment = diff / snake.length;
-  int bodyHue = BLUE_HUE;
-  for (Line *l : snake.body.queue)
+  const double degreesPerUnit = 360 / 4294967296.0;
+  int32_t pids[SHARED_CLOCK_FOLLOWERS] = {};
+  uint64_t frames[SHARED_CLOCK_FOLLOWERS];
+  uint64_t lagSumUs[SHARED_CLOCK_FOLLOWERS];
+  uint64_t apartSum[SHARED_CLOCK_FOLLOWERS];
+  for (long second = 1; seconds == 0 || second <= seconds; second++)
   {
-    if (l != NULL)
+    sleep(1);
+    long long nowUs = monotonicMicros();
+    uint64_t shown = shared->shown.load(std::memory_order_acquire);
+    printf("second %ld: %.2f s a turn, leader drew %.1f degrees %.1f ms ago\n", second, shared->anchor.periodUs / 1e6,
+           (uint32_t)(shown >> 32) * degreesPerUnit, shown ? (uint32_t)((uint32_t)nowUs - (uint32_t)shown) / 1000.0 : -1.0);
+    for (int i = 0; i < SHARED_CLOCK_FOLLOWERS; i++)
     {
-      l->setHue(bodyHue);
-      bodyHue -= increment;
+      const SharedClockFollower &slot = shared->follower[i];
+      int32_t pid = slot.pid.load(std::memory_order_acquire);
+      if (pid == 0 || (kill(pid, 0) != 0 && errno == ESRCH))
+      {
+        pids[i] = 0;
+        continue;
+      }
+      if (pid != pids[i])
+      {
+        // Newly attached: count from here
+        pids[i] = pid;
+        frames[i] = lagSumUs[i] = apartSum[i] = 0;
+      }
+      uint64_t nowFrames = slot.frames.load(std::memory_order_relaxed);
+      uint64_t nowLagSumUs = slot.lagSumUs.load(std::memory_order_relaxed);
+      uint64_t nowApartSum = slot.apartSum.load(std::memory_order_relaxed);
+      uint64_t drawn = nowFrames - frames[i];
+      printf("  pid %d: %llu frames, %.0f us behind the leader's on average, %llu us at worst, %.2f degrees of hue from the leader's frame on average, %.2f at worst\n",
+             pid, (unsigned long long)drawn, drawn ? (double)(nowLagSumUs - lagSumUs[i]) / drawn : 0.0,
+             (unsigned long long)slot.worstLagUs.load(std::memory_order_relaxed),
+             drawn ? (nowApartSum - apartSum[i]) * degreesPerUnit / drawn : 0.0,
+             slot.worstApart.load(std::memory_order_relaxed) * degreesPerUnit);
+      frames[i] = nowFrames;
+      lagSumUs[i] = nowLagSumUs;
+      apartSum[i] = nowApartSum;
     }
+    fflush(stdout);
   }
-
-  snake.head()->setHue(GREEN_HUE);
+  munmap(memory, sizeof(SharedClock));
+  return 0;
 }
+#endif
 
-// Get the direction the user is trying to move the snake
-int getDirection()
+#if defined(LAPTOP_MODE) && !defined(FUZZ)
+// Replaces the global new to count into heapAllocations. Kept out of line, or GCC takes the inlined
+// free() for a mismatched delete.
+__attribute__((noinline)) void *operator new(size_t size)
 {
-#ifdef MICRO_MODE
-  bool leftButton = digitalRead(4);
-  bool rightButton = digitalRead(5);
-  if (leftButton)
+  if (countsAllocations)
   {
-    Serial.println("LEFT");
-    return LEFT;
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
   }
-  if (rightButton)
+  void *memory = malloc(size == 0 ? 1 : size);
+  if (memory == NULL)
   {
-    Serial.println("RIGHT");
-    return RIGHT;
+    throw std::bad_alloc();
   }
-  return STRAIGHT;
-#endif
-
-  return direction;
+  return memory;
 }
+__attribute__((noinline)) void operator delete(void *memory) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept { free(memory); }
 
-int startedVisualizationMs = 0;
-
-int getMilliCount()
-{
-#ifdef LAPTOP_MODE
-  timeb tb;
-  ftime(&tb);
-  int nCount = tb.millitm + (tb.time & 0xfffff) * 1000;
-  return nCount;
+int main(int argc, const char *argv[])
+{ // Only called for LAPTOP_MODE
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+  {
+    return runBenchmarks(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-compare") == 0)
+  {
+    return compareBenchmarks(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--dump") == 0)
+  {
+    return runDump(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--compare") == 0)
+  {
+    return runCompare(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--compile-animation") == 0)
+  {
+    return compileAnimation(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--compile-layout") == 0)
+  {
+    return compileLayout(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--export-layout") == 0)
+  {
+    return exportLayout(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--layout-info") == 0)
+  {
+    return layoutInfo(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--decode-trace") == 0)
+  {
+    return decodeTrace(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--equivalence") == 0)
+  {
+    return runEquivalence(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--watch") == 0)
+  {
+    return watchFrames(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--watch-clock") == 0)
+  {
+    return watchClock(argc - 2, argv + 2);
+  }
+  // Options for the windowed game
+  RealtimeOptions realtime;
+  int boardCount = 1;
+  // The last option given that follows a single board
+  const char *singleBoardOption = NULL;
+  const char *layoutPath = NULL;
+  const char *configPath = NULL;
+  const char *audioPath = NULL;
+  int audioRate = 44100;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--realtime") == 0)
+    {
+      realtime.enabled = true;
+      singleBoardOption = argv[i];
+    }
+    else if (i + 1 == argc)
+    {
+      break;
+    }
+    else if (strcmp(argv[i], "--boards") == 0)
+    {
+      boardCount = get_max(atoi(argv[++i]), 1);
+    }
+    else if (strcmp(argv[i], "--fps") == 0)
+    {
+      realtime.fps = get_max(atoi(argv[++i]), 1);
+    }
+    else if (strcmp(argv[i], "--sim-cpu") == 0)
+    {
+      realtime.simCpu = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--render-cpu") == 0)
+    {
+      realtime.renderCpu = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--sim-priority") == 0)
+    {
+      realtime.simPriority = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--render-priority") == 0)
+    {
+      realtime.renderPriority = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--trace") == 0)
+    {
+      singleBoardOption = argv[i];
+      traceLog.begin(fopen(argv[++i], "wb"));
+    }
+    else if (strcmp(argv[i], "--publish") == 0)
+    {
+      singleBoardOption = argv[i];
+      if (!framePublisher.open(argv[++i]))
+      {
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--lead-clock") == 0)
+    {
+      singleBoardOption = argv[i];
+      if (!sharedClock.lead(argv[++i]))
+      {
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--follow-clock") == 0)
+    {
+      singleBoardOption = argv[i];
+      if (!sharedClock.follow(argv[++i]))
+      {
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--layout") == 0)
+    {
+      layoutPath = argv[++i];
+      if (!mappedLayout.open(layoutPath))
+      {
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--config") == 0)
+    {
+      singleBoardOption = argv[i];
+      configPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--audio") == 0)
+    {
+      audioPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--audio-rate") == 0)
+    {
+      audioRate = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--play") == 0)
+    {
+      if (!loadAnimation(argv[++i]))
+      {
+        return 1;
+      }
+      effects.select(effects.count() - 1);
+      realtime.effect = effects.count() - 1;
+    }
+    else if (strcmp(argv[i], "--profile") == 0)
+    {
+#ifdef PROFILE
+      profilePath = argv[++i];
 #else
-  return millis();
+      i++;
+      fprintf(stderr, "Build with -DPROFILE to record a profile\n");
 #endif
-}
+    }
+  }
 
-int countdownToPollSpeed = 20; // Prevent polling every frame.
-int msPerVizualizationRotation = 5000;
-float getPercentThroughVisualization()
-{
-  int milliCount = getMilliCount();
-  countdownToPollSpeed--;
-  if (countdownToPollSpeed < 0)
+  if (boardCount > 1 && singleBoardOption != NULL)
   {
-    msPerVizualizationRotation = getMillisPerVisualizationRevolution();
-    countdownToPollSpeed = 20;
+    fprintf(stderr, "%s follows a single board and can't be used with --boards\n", singleBoardOption);
+    return 1;
   }
-  int nSpan = milliCount - startedVisualizationMs;
-  if (nSpan > msPerVizualizationRotation)
+  if (configPath != NULL && !configWatcher.start(configPath, layoutPath))
   {
-    startedVisualizationMs = milliCount;
-    nSpan = 0;
+    return 1;
   }
-
-  int ms = nSpan % msPerVizualizationRotation; // ms is between 0 and msPerVizualizationRotation
-  float percent = ms / (float)msPerVizualizationRotation;
-  return percent;
-}
-
-int getMillisPerVisualizationRevolution()
-{
-#ifdef LAPTOP_MODE
-  return 5000;
-#endif
-  float speedPercent = 1 - (analogRead(DIAL_PIN_SPEED) / 1024.0);
-  int slowestSpeed = 500;
-  int fastestSpeed = 10000;
-  return speedPercent * (fastestSpeed - slowestSpeed) + slowestSpeed;
-}
-
-void tick()
-{
-  if (isRainbowMode())
+  if (audioRate < AUDIO_MIN_RATE || audioRate > AUDIO_MAX_RATE)
   {
-    float centerX = 0.5;
-    float centerY = 0.5;
-#ifdef MICRO_MODE
-    centerX = analogRead(DIAL_PIN_X) / 1024.0;
-    centerY = analogRead(DIAL_PIN_Y) / 1024.0;
-#endif
-
-    if (startedVisualizationMs == 0)
+    fprintf(stderr, "--audio-rate must be between %d and %d\n", AUDIO_MIN_RATE, AUDIO_MAX_RATE);
+    return 1;
+  }
+  if (audioPath != NULL)
+  {
+    if (!audioInput.open(audioPath, audioRate))
     {
-      startedVisualizationMs = getMilliCount();
+      return 1;
+    }
+    audioInput.start();
+    realtime.effect = SPECTRUM_EFFECT;
+    // Counted on one board's thread only
+    if (boardCount == 1)
+    {
+      audioLatency.begin(1000000 / realtime.fps);
     }
+  }
 
-    float percentThroughColorWheel = getPercentThroughVisualization();
-    colorWheel(centerX, centerY, percentThroughColorWheel * 360);
+  SDL_Init(SDL_INIT_VIDEO);
+  _window = SDL_CreateWindow("PLAC-MAN", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 700, 500, SDL_WINDOW_RESIZABLE);
+  renderer = SDL_CreateRenderer(_window, -1, SDL_RENDERER_ACCELERATED);
+  previewTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                     PREVIEW_WIDTH, PREVIEW_HEIGHT);
+  if (boardCount > 1)
+  {
+    runTiled(boardCount, realtime.effect);
+  }
+  else if (realtime.enabled)
+  {
+    runRealtime(realtime);
   }
-  else // Snake mode
+  else
   {
-    if (lossAnimation <= 0)
+    SDL_Event e;
+    Game<LaptopPlatform>::setup();
+    if (realtime.effect >= 0)
     {
-      snake.move(getDirection());
-      direction = STRAIGHT;
-      if (cherry == snake.head())
-      {
-        snake.grow();
-        randomizeCherry();
-      }
+      // Selected once the lines are there, for effects that place themselves on them
+      effects.select(realtime.effect);
     }
-    else
+
+    bool quit = false;
+    while (!quit)
     {
-      lossAnimation--;
-      if (lossAnimation == 0)
+      while (SDL_PollEvent(&e))
       {
-        // We're on the last frame of the loss animation
-        snake.reset();
-        randomizeCherry();
+        if (e.type == SDL_QUIT)
+        {
+          quit = true;
+        }
+        if (e.type == SDL_KEYDOWN)
+        {
+          PROFILE_INSTANT("key", e.key.keysym.sym);
+          handleKey(e.key.keysym.sym);
+        }
       }
+
+      Game<LaptopPlatform>::loop();
     }
   }
-}
-
-void setup()
-{ // Called for both modes
-  initLines();
-  snake.reset();
-  randomizeCherry();
-
-#ifdef MICRO_MODE
-  Serial.begin(9600);       // set up Serial library at 9600 bps
-  strip.begin();            // INITIALIZE NeoPixel strip object (REQUIRED)
-  strip.show();             // Turn OFF all pixels ASAP
-  strip.setBrightness(255); // Set BRIGHTNESS to about 1/5 (max = 255)
-  Serial.println(analogRead(A4));
-  randomSeed(analogRead(A4));
+  if (audioLatency.enabled())
+  {
+    audioLatency.report("Audio to rendered frame");
+  }
 
-  pinMode(4, INPUT_PULLUP);
-  pinMode(5, INPUT_PULLUP);
-  pinMode(6, INPUT_PULLUP);
-  // Initialize analog pins
-  pinMode(DIAL_PIN_X, INPUT_PULLUP);
-  pinMode(DIAL_PIN_Y, INPUT_PULLUP);
-  pinMode(DIAL_PIN_SPEED, INPUT_PULLUP);
+  if (previewTexture)
+  {
+    SDL_DestroyTexture(previewTexture);
+  }
+  if (renderer)
+  {
+    SDL_DestroyRenderer(renderer);
+  }
+  SDL_DestroyWindow(_window);
+  SDL_Quit();
+  traceLog.end();
+  framePublisher.close();
+  sharedClock.close();
+  configWatcher.stop();
+  audioInput.close();
+#ifdef PROFILE
+  if (profilePath)
+  {
+    profiler.write(profilePath);
+  }
 #endif
-}
 
-void delay_ms(int ms)
-{
-#ifdef LAPTOP_MODE
-  SDL_Delay(ms);
-#endif
-#ifdef MICRO_MODE
-  delay(ms);
-#endif
+  return 0;
 }
+#endif
 
-void loop()
+// Fills the snake layer and the cherry and loss flash overlay
+void assignColors()
 {
-  if (!isRainbowMode())
+  PROFILE_SCOPE("assignColors");
+  // Each line's hue for this board. Kept here rather than in lines[], which every board shares.
+  // Lines the snake isn't on stay transparent.
+  int hues[32];
+  for (byte i = 0; i < lineCount(); i++)
   {
-    assignColors();
+    hues[i] = -1;
   }
 
-  draw();
-  updateStrip();
-
-  if (!isRainbowMode())
+  int diff = BLUE_HUE - GREEN_HUE;
+  int increment = diff / snake.length;
+  int bodyHue = BLUE_HUE;
+  for (byte k = 0; k < snake.body.getLength(); k++)
   {
-    delay_ms(lossAnimation > 0 ? 200 : 500);
+    hues[snake.body.at(k)->id()] = bodyHue;
+    bodyHue -= increment;
   }
 
-  tick();
-}
-
-void draw()
-{
-#ifdef LAPTOP_MODE
-  SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
-  SDL_RenderClear(renderer);
+  hues[snake.head()->id()] = GREEN_HUE;
 
-  int scale = 80;
+  for (byte i = 0; i < lineCount(); i++)
+  {
+    setLineColor(snakeLayer, i, hues[i] == -1 ? TRANSPARENT : hueColor(hues[i]));
+    setLineColor(overlayLayer, i, TRANSPARENT);
+  }
 
-  for (Line l : lines)
+  // Fade each body segment into the color of the next one toward the head, so the body is one
+  // continuous gradient from tail to head
+  for (byte k = 0; k + 1 < snake.body.getLength(); k++)
   {
-    thickLineRGBA(renderer,
-                  l.startX() * scale, l.startY() * scale, l.endX() * scale, l.endY() * scale,
-                  15, l.R(), l.G(), l.B(), 255);
+    Line *segment = snake.body.at(k);
+    Line *next = snake.body.at(k + 1);
+    Rgb from = hueColor(hues[segment->id()]);
+    Rgb to = hueColor(hues[next->id()]);
+    if (touchesAtEnd(segment, next))
+    {
+      setLineGradient(snakeLayer, segment->id(), from, to);
+    }
+    else
+    {
+      setLineGradient(snakeLayer, segment->id(), to, from);
+    }
   }
 
-  SDL_RenderPresent(renderer);
-#endif
-}
+  if (cherry != NULL && cherryVisible)
+  {
+    setLineColor(overlayLayer, cherry->id(), hueColor(RED_HUE));
+  }
 
-void updateStrip()
-{
-#ifdef MICRO_MODE
-  for (byte i = 0; i < actualLedCount(); i++)
+  // The loss animation alternates the whole board between red and dim
+  if (lossAnimation > 0)
   {
-    if (i < strip.numPixels())
+    Rgb flash = hueColor(lossAnimation % 2 == 0 ? RED_HUE : -1);
+    for (byte i = 0; i < lineCount(); i++)
     {
-      strip.setPixelColor(actual_leds[i], strip.Color(lines[i].R(), lines[i].G(), lines[i].B()));
+      setLineColor(overlayLayer, i, flash);
     }
   }
-  strip.show();
-#endif
 }
 
 void h2rgb(float H, int &R, int &G, int &B)
@@ -853,3 +7381,126 @@ void h2rgb(float H, int &R, int &G, int &B)
     B = (1 - var_b) * 255;
   }
 }
+
+#ifdef MOCK_MICRO
+// Runs the micro build against the simulated board and estimates how it would run on the real one
+//   [--frames N] [--snake] [--dials X Y SPEED] [--turn-every MS] [--cpu-scale F] [--cost NAME CYCLES]
+//   [--capture FILE] [--trace FILE]
+int main(int argc, const char *argv[])
+{
+  int frames = 2000;
+  int turnEvery = 0;
+  mockPins[6] = true;
+  mockAnalog[DIAL_PIN_X] = mockAnalog[DIAL_PIN_Y] = mockAnalog[DIAL_PIN_SPEED] = 512;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+    {
+      frames = atoi(argv[++i]);
+      if (frames < 1)
+      {
+        fprintf(stderr, "--frames must be at least 1\n");
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--snake") == 0)
+      mockPins[6] = false;
+    else if (strcmp(argv[i], "--dials") == 0 && i + 3 < argc)
+    {
+      mockAnalog[DIAL_PIN_X] = atoi(argv[++i]);
+      mockAnalog[DIAL_PIN_Y] = atoi(argv[++i]);
+      mockAnalog[DIAL_PIN_SPEED] = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--turn-every") == 0 && i + 1 < argc)
+      turnEvery = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--cpu-scale") == 0 && i + 1 < argc)
+      mockCpuScale = atof(argv[++i]);
+    else if (strcmp(argv[i], "--cost") == 0 && i + 2 < argc)
+    {
+      const char *name = argv[++i];
+      double cycles = atof(argv[++i]);
+      if (strcmp(name, "digitalRead") == 0)
+        mockCosts.digitalRead = cycles;
+      else if (strcmp(name, "analogRead") == 0)
+        mockCosts.analogRead = cycles;
+      else if (strcmp(name, "millis") == 0)
+        mockCosts.millis = cycles;
+      else if (strcmp(name, "random") == 0)
+        mockCosts.random = cycles;
+      else if (strcmp(name, "trace") == 0)
+        mockCosts.trace = cycles;
+      else if (strcmp(name, "showPerLed") == 0)
+        mockCosts.showPerLed = cycles;
+      else if (strcmp(name, "showOverhead") == 0)
+        mockCosts.showOverhead = cycles;
+      else
+      {
+        fprintf(stderr, "Unknown cost %s\n", name);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+      strip.capture = fopen(argv[++i], "wb");
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      traceLog.begin(fopen(argv[++i], "wb"));
+  }
+
+  mockHostTime = std::chrono::steady_clock::now();
+  setup();
+  std::vector<double> frameMicros;
+  frameMicros.reserve(frames);
+  for (int frame = 0; frame < frames; frame++)
+  {
+    if (turnEvery > 0)
+    {
+      // Hold left, let go, hold right, let go
+      int phase = (int)(mockMicros() / 1000 / turnEvery) % 4;
+      mockPins[4] = phase == 1;
+      mockPins[5] = phase == 3;
+    }
+    double start = mockMicros();
+    loop();
+    // Charge the rest of the frame before timing it
+    mockSpend(0, mockComputeCycles);
+    frameMicros.push_back(mockMicros() - start);
+  }
+  if (strip.capture)
+  {
+    fclose(strip.capture);
+  }
+
+  traceLog.end();
+
+  std::vector<double> sorted = frameMicros;
+  std::sort(sorted.begin(), sorted.end());
+  double total = 0;
+  for (double micros : frameMicros)
+    total += micros;
+  double mean = total / frames;
+  printf("Estimated frame time over %d frames at %.0fx host time:\n", frames, mockCpuScale);
+  printf("  mean %.0f us (%.1f fps), min %.0f, p99 %.0f, max %.0f\n", mean, 1000000 / mean, sorted[0],
+         sorted[frames * 99 / 100], sorted[frames - 1]);
+  printf("  compute %.1f%%, show() %.1f%%, core calls and tracing %.1f%%\n",
+         100 * mockComputeCycles / mockCycles, 100 * mockShowCycles / mockCycles, 100 * mockCoreCycles / mockCycles);
+  printf("  millis() lost %.0f ms of %.0f ms to interrupts being off\n", mockLostMicros / 1000, mockMicros() / 1000);
+
+  if (mockTicks.size() > 2)
+  {
+    double sum = 0;
+    double squares = 0;
+    double worst = 0;
+    for (size_t i = 1; i < mockTicks.size(); i++)
+    {
+      double late = (mockTicks[i] - mockTicks[i - 1]) / 1000 - SNAKE_STEP_MS;
+      sum += late;
+      squares += late * late;
+      worst = late > worst ? late : worst;
+    }
+    int count = mockTicks.size() - 1;
+    double meanLate = sum / count;
+    printf("Snake ticks: %d, %d ms apart plus %.2f ms on average, jitter %.2f ms, worst %.2f ms\n", count,
+           SNAKE_STEP_MS, meanLate, sqrt(squares / count - meanLate * meanLate), worst);
+  }
+  return 0;
+}
+#endif